@@ -0,0 +1,73 @@
+#pragma once
+
+#include <vector>
+#include <stdint.h>
+#include <Box2D.h>
+
+#include "util.hh"
+
+class Actor;
+
+/// Perception queries each AI actor makes before thinking, in this order
+enum AISense { SENSE_TARGET, SENSE_WALL, SENSE_GROUND, SENSES };
+
+/// Buttons an AI actor holds down, applied every tick the way a player's keys are
+struct AIKeys {
+	AIKeys(): dir(0), up(false), down(false), action(false) { }
+	int dir; ///< -1 left, 1 right, 0 neither
+	bool up;
+	bool down;
+	bool action; ///< Pressed once, cleared when used
+};
+
+/// Read-only copy of what bots look at, taken under the world lock
+/// so that they can think on other threads while nothing moves
+struct AIView {
+	struct Body {
+		const Actor* actor;
+		uint16_t id;
+		const b2Body* body;
+		b2Vec2 pos;
+		bool dead;
+		bool invisible;
+		bool airborne;
+		bool on_ladder;
+		int dir;     ///< Facing
+		int jumping;
+		int powerup; ///< Powerup::Type
+	};
+	/// Look up actors by id from now on, after filling them in
+	void reindex() {
+		index.assign(index.size(), -1);
+		for (size_t i = 0; i < actors.size(); ++i) {
+			if (actors[i].id >= index.size()) index.resize(actors[i].id + 1, -1);
+			index[actors[i].id] = i;
+		}
+	}
+	const Body* find(uint16_t id) const {
+		return id < index.size() && index[id] >= 0 ? &actors[index[id]] : NULL;
+	}
+	std::vector<Body> actors;
+	std::vector<b2Vec2> powerups;
+	std::vector<int> index; ///< Position in actors by actor id, -1 for none
+};
+
+/// What an AI actor is up to, each one thinks on its own schedule
+struct AIState {
+	AIState(): stopped(false), next(0), target(0, 0), target_id(0), has_target(false), target_sensed(false), senses(0), action(false) { }
+	AIKeys keys;           ///< Decided by the latest think
+	AIKeys held;           ///< Applied on the previous tick, to detect releases
+	Countdown goal;        ///< Pick a new goal when this runs out
+	Countdown wander;      ///< Next random decision when there is nowhere to go
+	bool stopped;          ///< Standing still while wandering
+	std::vector<int> path; ///< Navigation nodes to the goal
+	size_t next;           ///< Position in path being headed to
+	Countdown stuck;       ///< Give up on the path if the next node isn't reached in time
+	b2Vec2 target;         ///< Goal position
+	uint16_t target_id;    ///< Actor being chased, 0 for a power-up
+	bool has_target;       ///< Whether the latest goal found a target
+	bool target_sensed;    ///< This tick's SENSE_TARGET ray was cast at the target
+	size_t senses;         ///< First of this tick's perception results
+	bool action;           ///< Use the power-up after the physics step
+	Rng rng;               ///< Random decisions, seeded by the world
+};
@@ -0,0 +1,24 @@
+#include <cstdlib>
+#include <new>
+
+#include "allocations.hh"
+
+namespace {
+	thread_local uint64_t allocations = 0;
+
+	void* allocate(std::size_t size) {
+		++allocations;
+		if (void* p = std::malloc(size ? size : 1)) return p;
+		throw std::bad_alloc();
+	}
+}
+
+
+uint64_t threadAllocations() { return allocations; }
+
+
+// The nothrow and array forms of the standard library call these
+void* operator new(std::size_t size) { return allocate(size); }
+void* operator new[](std::size_t size) { return allocate(size); }
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
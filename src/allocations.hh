@@ -0,0 +1,8 @@
+#pragma once
+
+#include <stdint.h>
+
+/// Number of times the calling thread has called operator new so far.
+/// The global operator new is replaced in allocations.cc to count them,
+/// which costs one thread-local increment per allocation.
+uint64_t threadAllocations();
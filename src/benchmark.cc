@@ -0,0 +1,91 @@
+#include <map>
+#include <iomanip>
+#include <algorithm>
+#include <stdexcept>
+
+#include "benchmark.hh"
+#include "inputlog.hh"
+#include "allocations.hh"
+#include "world.hh"
+#include "texture.hh"
+#include "gamemode.hh"
+
+namespace {
+	/// Nearest-rank percentile of sorted values
+	double percentile(const std::vector<double>& sorted, double p) {
+		if (sorted.empty()) return 0.0;
+		size_t rank = size_t(p / 100.0 * sorted.size() + 0.5);
+		return sorted[std::min(sorted.size() - 1, rank ? rank - 1 : 0)];
+	}
+}
+
+
+void BenchmarkStats::write(std::ostream& os) const {
+	std::vector<double> sorted(tick_ms);
+	std::sort(sorted.begin(), sorted.end());
+	size_t ticks = sorted.size();
+	os << std::fixed << std::setprecision(4);
+	os << "[Benchmark]" << std::endl;
+	os << "ticks = " << ticks << std::endl;
+	os << "tick_p50 = " << percentile(sorted, 50) << std::endl;
+	os << "tick_p90 = " << percentile(sorted, 90) << std::endl;
+	os << "tick_p99 = " << percentile(sorted, 99) << std::endl;
+	os << "tick_max = " << (ticks ? sorted.back() : 0.0) << std::endl;
+	os << std::setprecision(2);
+	os << "allocations_per_tick = " << (ticks ? double(allocations) / ticks : 0.0) << std::endl;
+	os << "snapshot_bytes = " << (ticks ? double(snapshot_bytes) / ticks : 0.0) << std::endl;
+	os << "snapshot_max = " << snapshot_max << std::endl;
+	os << "hash = " << std::hex << hash << std::dec << std::endl;
+	// Timings of a desynced playback measure some other match
+	os << "result = " << (!finished ? "unchecked" : hash == expected ? "ok" : "desync") << std::endl;
+}
+
+
+BenchmarkStats benchmark(const InputLogReader& log, const GameMode& gm) {
+	SimulatedClock clock;
+	UseClock use(&clock);
+	TextureMap tm;
+	World world(log.width(), log.height(), tm, gm, true, log.seed());
+	world.setVerbose(false);
+	world.keepEvents(true); // Taken every tick like a server does
+	if (!world.isDeterministic()) throw std::runtime_error("Input logs only play back in deterministic mode");
+	BenchmarkStats stats;
+	std::map<uint16_t, Actor*> actors; // Recorded ids to the ones given now
+	std::vector<char> snapshot(4096);
+	const InputLogReader::Records& records = log.records();
+	size_t next = 0;
+	while (!world.gameOver() && world.getTick() < log.lastTick()) {
+		// What happened at this tick boundary
+		for (; next < records.size() && records[next].tick <= world.getTick(); ++next) {
+			const InputLogRecord& r = records[next];
+			std::map<uint16_t, Actor*>::iterator it = actors.find(r.id);
+			switch (r.type) {
+				case INPUTLOG_SPAWN:
+					actors[r.id] = world.spawnActor(Actor::Type(r.actor), r.character);
+					break;
+				case INPUTLOG_REMOVE:
+					if (it == actors.end()) break;
+					world.removeActor(it->second);
+					actors.erase(it);
+					break;
+				case INPUTLOG_INPUT:
+					if (it != actors.end()) world.input(it->second, r.input, r.view_tick);
+					break;
+			}
+		}
+		uint64_t allocations = threadAllocations();
+		double t = GetPreciseSecs();
+		world.update();
+		stats.tick_ms.push_back((GetPreciseSecs() - t) * 1000.0);
+		stats.allocations += threadAllocations() - allocations;
+		world.takeEvents();
+		size_t size;
+		while ((size = world.serialize(&snapshot[0], snapshot.size())) > snapshot.size()) snapshot.resize(size);
+		stats.snapshot_bytes += size;
+		stats.snapshot_max = std::max(stats.snapshot_max, size);
+	}
+	stats.hash = world.getStateHash();
+	stats.finished = log.finished();
+	if (stats.finished) stats.expected = records.back().hash;
+	return stats;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <iostream>
+#include <vector>
+#include <stdint.h>
+
+class GameMode;
+class InputLogReader;
+
+/// Costs of a recorded match played back headless
+struct BenchmarkStats {
+	BenchmarkStats(): allocations(), snapshot_bytes(), snapshot_max(), hash(), expected(), finished() { }
+	/// Ini-style report, perf-regress compares these between runs
+	void write(std::ostream& os) const;
+
+	std::vector<double> tick_ms; ///< Wall time of each update()
+	uint64_t allocations;        ///< Made by update() over all ticks
+	uint64_t snapshot_bytes;     ///< Full dynamic snapshots of all ticks together
+	size_t snapshot_max;
+	uint32_t hash;               ///< State hash at the end of the playback
+	uint32_t expected;           ///< The recorded one
+	bool finished;               ///< The log had its end record to check against
+};
+
+/// Feed the recorded input to a deterministic world on the calling thread,
+/// timing every tick. The world must be set up like it was when recording.
+BenchmarkStats benchmark(const InputLogReader& log, const GameMode& gm);
@@ -9,6 +9,7 @@
 
 #cmakedefine USE_THREADS
 #cmakedefine USE_NETWORK
+#cmakedefine USE_PROFILER
 
 #endif
 
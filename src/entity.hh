@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stdint.h>
 #include <Box2D.h>
 #include <GL/gl.h>
 
@@ -8,10 +9,13 @@
 class World;
 
 struct SerializedEntity {
+	enum Flags { HIDDEN = 1 }; ///< Sent without its state, e.g. an invisible actor
 	float x, y, vx, vy, a, va;
-	char id, type;
+	uint16_t id;
+	int8_t type;   ///< Meaning depends on the entity
+	uint8_t flags;
 	SerializedEntity(float x, float y, float vx = 0, float vy = 0, float a = 0, float va = 0):
-		x(x), y(y), vx(vx), vy(vy), a(a), va(va), id(0), type(0) {}
+		x(x), y(y), vx(vx), vy(vy), a(a), va(va), id(0), type(0), flags(0) {}
 	operator char*() { return reinterpret_cast<char*>(this); } /// overload char cast
 	operator char const*() const { return reinterpret_cast<char const*>(this); } /// overload char const cast
 };
@@ -38,12 +42,11 @@ struct Entity {
 		return SerializedEntity(pos.x, pos.y, vel.x, vel.y, b->GetAngle(), b->GetAngularVelocity());
 	}
 
-	virtual void unserialize(std::string data) {
-		SerializedEntity* se = reinterpret_cast<SerializedEntity*>(&data[0]);
+	virtual void unserialize(const SerializedEntity& se) {
 		b2Body* b = getBody();
-		b->SetTransform(b2Vec2(se->x, se->y), se->a);
-		b->SetLinearVelocity(b2Vec2(se->vx, se->vy));
-		b->SetAngularVelocity(se->va);
+		b->SetTransform(b2Vec2(se.x, se.y), se.a);
+		b->SetLinearVelocity(b2Vec2(se.vx, se.vy));
+		b->SetAngularVelocity(se.va);
 	}
 
 	float32 getX() const { return body->GetPosition().x; }
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <vector>
+#include <cstddef>
+#include <stdint.h>
+
+/// Gameplay event that clients must not miss, sent on the reliable channel.
+/// Actors are referred to by their id, 0 meaning none.
+struct GameEvent {
+	enum Type { JOIN = 1, LEAVE, KILL, PICKUP, ROUND_END };
+	GameEvent(Type type = JOIN, uint16_t actor = 0, uint16_t other = 0, int16_t value = 0):
+	  type(type), actor(actor), other(other), value(value) { }
+	Type type;
+	uint16_t actor; ///< Joined / left / killed / picking up actor
+	uint16_t other; ///< Killer
+	int16_t value;  ///< Power-up type or number of rounds left
+};
+
+typedef std::vector<GameEvent> GameEvents;
+
+/// Size of an encoded event: type, actor, other, value, little-endian
+static const size_t EVENT_SIZE = 7;
+
+inline void encodeEvent(const GameEvent& ev, char* p) {
+	p[0] = ev.type;
+	p[1] = ev.actor & 0xFF; p[2] = ev.actor >> 8;
+	p[3] = ev.other & 0xFF; p[4] = ev.other >> 8;
+	p[5] = ev.value & 0xFF; p[6] = ev.value >> 8;
+}
+
+inline GameEvent decodeEvent(const unsigned char* p) {
+	return GameEvent(GameEvent::Type(p[0]), p[1] | (p[2] << 8), p[3] | (p[4] << 8), int16_t(p[5] | (p[6] << 8)));
+}
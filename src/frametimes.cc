@@ -0,0 +1,195 @@
+#include <iostream>
+#include <algorithm>
+#include <sstream>
+#include <iomanip>
+#include <SDL.h>
+#include <GL/gl.h>
+
+#include "frametimes.hh"
+#include "font.hh"
+#include "util.hh"
+
+#ifndef APIENTRY
+#define APIENTRY
+#endif
+#ifndef GL_TIME_ELAPSED
+#define GL_TIME_ELAPSED 0x88BF
+#endif
+#ifndef GL_QUERY_RESULT
+#define GL_QUERY_RESULT 0x8866
+#endif
+#ifndef GL_QUERY_RESULT_AVAILABLE
+#define GL_QUERY_RESULT_AVAILABLE 0x8867
+#endif
+
+namespace {
+	static const double FRAME_BUCKET = 0.1; // ms, up to 100 ms
+	static const size_t FRAME_BUCKETS = 1001;
+	static const size_t TICK_BUCKETS = 17;
+}
+
+
+RollingHistogram::RollingHistogram(size_t window, double bucket_width, size_t buckets):
+  m_samples(window), m_buckets(buckets), m_width(bucket_width), m_next(0), m_count(0) { }
+
+
+size_t RollingHistogram::bucket(double v) const {
+	if (v <= 0.0) return 0;
+	return std::min(m_buckets.size() - 1, size_t(v / m_width));
+}
+
+
+void RollingHistogram::add(double v) {
+	if (m_count == m_samples.size()) --m_buckets[bucket(m_samples[m_next])];
+	else ++m_count;
+	m_samples[m_next] = v;
+	++m_buckets[bucket(v)];
+	m_next = (m_next + 1) % m_samples.size();
+}
+
+
+double RollingHistogram::percentile(double p) const {
+	if (!m_count) return 0.0;
+	size_t rank = std::max<size_t>(1, size_t(p / 100.0 * m_count + 0.5)), seen = 0;
+	for (size_t i = 0; i < m_buckets.size(); ++i) {
+		seen += m_buckets[i];
+		// The catch-all bucket has no upper bound
+		if (seen >= rank) return i + 1 < m_buckets.size() ? i * m_width : worst();
+	}
+	return worst();
+}
+
+
+double RollingHistogram::worst() const {
+	if (!m_count) return 0.0;
+	return *std::max_element(m_samples.begin(), m_samples.begin() + m_count);
+}
+
+
+/// GL_ARB_timer_query or GL_EXT_timer_query, loaded at run time since
+/// the headers may be older than the driver. Results are read a few frames
+/// late so that asking for them never waits for the GPU.
+struct FrameTimes::GpuQueries {
+	typedef void (APIENTRY *GenQueries)(GLsizei, GLuint*);
+	typedef void (APIENTRY *DeleteQueries)(GLsizei, const GLuint*);
+	typedef void (APIENTRY *BeginQuery)(GLenum, GLuint);
+	typedef void (APIENTRY *EndQuery)(GLenum);
+	typedef void (APIENTRY *GetQueryObjectiv)(GLuint, GLenum, GLint*);
+	typedef void (APIENTRY *GetQueryObjectui64v)(GLuint, GLenum, uint64_t*);
+	static const size_t COUNT = 4;
+
+	static GpuQueries* create() {
+		const char* ui64 = NULL;
+		if (SDL_GL_ExtensionSupported("GL_ARB_timer_query")) ui64 = "glGetQueryObjectui64v";
+		else if (SDL_GL_ExtensionSupported("GL_EXT_timer_query")) ui64 = "glGetQueryObjectui64vEXT";
+		if (!ui64) return NULL;
+		GpuQueries* q = new GpuQueries();
+		q->gen = reinterpret_cast<GenQueries>(SDL_GL_GetProcAddress("glGenQueries"));
+		q->del = reinterpret_cast<DeleteQueries>(SDL_GL_GetProcAddress("glDeleteQueries"));
+		q->begin = reinterpret_cast<BeginQuery>(SDL_GL_GetProcAddress("glBeginQuery"));
+		q->end = reinterpret_cast<EndQuery>(SDL_GL_GetProcAddress("glEndQuery"));
+		q->available = reinterpret_cast<GetQueryObjectiv>(SDL_GL_GetProcAddress("glGetQueryObjectiv"));
+		q->result = reinterpret_cast<GetQueryObjectui64v>(SDL_GL_GetProcAddress(ui64));
+		if (!q->gen || !q->del || !q->begin || !q->end || !q->available || !q->result) {
+			delete q;
+			return NULL;
+		}
+		q->gen(COUNT, q->ids);
+		return q;
+	}
+
+	~GpuQueries() { if (del) del(COUNT, ids); }
+
+	GenQueries gen;
+	DeleteQueries del;
+	BeginQuery begin;
+	EndQuery end;
+	GetQueryObjectiv available;
+	GetQueryObjectui64v result;
+	GLuint ids[COUNT];
+	size_t next;    ///< Query of the coming frame
+	size_t pending; ///< Issued, results not read yet
+
+  private:
+	GpuQueries(): gen(), del(), begin(), end(), available(), result(), next(0), pending(0) { }
+};
+
+
+FrameTimes::FrameTimes():
+  m_cpu(WINDOW, FRAME_BUCKET, FRAME_BUCKETS), m_gpu(WINDOW, FRAME_BUCKET, FRAME_BUCKETS),
+  m_present(WINDOW, FRAME_BUCKET, FRAME_BUCKETS), m_ticks(WINDOW, 1.0, TICK_BUCKETS),
+  m_start(0), m_idle(0), m_lastPresent(0), m_tick(0), m_first(true), m_queries(GpuQueries::create())
+{
+	if (!m_queries) std::cout << "GPU timer queries not available, frame times are CPU only." << std::endl;
+}
+
+
+FrameTimes::~FrameTimes() {
+	delete m_queries;
+}
+
+
+void FrameTimes::begin(unsigned tick) {
+	m_start = GetPreciseSecs();
+	m_idle = 0;
+	if (!m_first) m_ticks.add(tick - m_tick);
+	m_tick = tick;
+	if (!m_queries) return;
+	// Every query still out would be overwritten next, wait for the oldest
+	readGpu(m_queries->pending == GpuQueries::COUNT);
+	m_queries->begin(GL_TIME_ELAPSED, m_queries->ids[m_queries->next]);
+}
+
+
+void FrameTimes::idle(double seconds) {
+	m_idle += seconds;
+}
+
+
+void FrameTimes::end() {
+	m_cpu.add((GetPreciseSecs() - m_start - m_idle) * 1000.0);
+	if (!m_queries) return;
+	m_queries->end(GL_TIME_ELAPSED);
+	m_queries->next = (m_queries->next + 1) % GpuQueries::COUNT;
+	++m_queries->pending;
+}
+
+
+void FrameTimes::presented() {
+	double now = GetPreciseSecs();
+	if (!m_first) m_present.add((now - m_lastPresent) * 1000.0);
+	m_lastPresent = now;
+	m_first = false;
+}
+
+
+void FrameTimes::readGpu(bool wait) {
+	GpuQueries& q = *m_queries;
+	while (q.pending) {
+		GLuint id = q.ids[(q.next + GpuQueries::COUNT - q.pending) % GpuQueries::COUNT];
+		GLint ready = 0;
+		if (!wait) q.available(id, GL_QUERY_RESULT_AVAILABLE, &ready);
+		if (!wait && !ready) return;
+		uint64_t ns = 0;
+		q.result(id, GL_QUERY_RESULT, &ns);
+		m_gpu.add(ns / 1e6);
+		--q.pending;
+		wait = false;
+	}
+}
+
+
+std::string FrameTimes::line(const char* name, const RollingHistogram& h, const char* unit) const {
+	std::ostringstream oss;
+	oss << std::fixed << std::setprecision(1) << name << " p50 " << h.percentile(50) << ", p95 " << h.percentile(95)
+	  << ", p99 " << h.percentile(99) << ", worst " << h.worst() << unit;
+	return oss.str();
+}
+
+
+void FrameTimes::draw(const Font& font, float x, float y) const {
+	font.drawText(x, y, line("CPU", m_cpu, " ms"));
+	font.drawText(x, y + 20, m_queries ? line("GPU", m_gpu, " ms") : "GPU n/a");
+	font.drawText(x, y + 40, line("Present", m_present, " ms"));
+	font.drawText(x, y + 60, line("Ticks per frame", m_ticks, ""));
+}
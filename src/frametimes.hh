@@ -0,0 +1,69 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <stdint.h>
+#include <boost/noncopyable.hpp>
+
+class Font;
+
+/// Distribution of the latest samples. Counts go in fixed-width buckets,
+/// the last one catching everything above, so percentiles cost a pass over
+/// the buckets rather than a sort.
+class RollingHistogram {
+  public:
+	RollingHistogram(size_t window, double bucket_width, size_t buckets);
+	void add(double v);
+	/// Sample at the given share of the window, rounded down to the bucket width
+	double percentile(double p) const;
+	/// Largest sample in the window
+	double worst() const;
+	size_t size() const { return m_count; }
+
+  private:
+	size_t bucket(double v) const;
+
+	std::vector<double> m_samples; ///< Ring of the window
+	std::vector<unsigned> m_buckets;
+	double m_width;
+	size_t m_next;
+	size_t m_count;
+};
+
+
+/// Frame timing of the client: CPU time up to the buffer swap, GPU time from
+/// timer queries where the driver has them, time between swaps and physics
+/// ticks simulated per frame. Averages hide hitches, so it reports tails.
+class FrameTimes: public boost::noncopyable {
+  public:
+	/// Needs the GL context, WINDOW frames are kept
+	FrameTimes();
+	~FrameTimes();
+
+	/// Start of the frame's work, with the world tick at that moment
+	void begin(unsigned tick);
+	/// Time spent waiting on purpose, not counted as CPU time
+	void idle(double seconds);
+	/// All drawing submitted, just before the swap
+	void end();
+	/// The swap returned
+	void presented();
+
+	/// p50/p95/p99 and worst frame of each, a line each
+	void draw(const Font& font, float x, float y) const;
+
+	static const size_t WINDOW = 1000;
+
+  private:
+	struct GpuQueries;
+	void readGpu(bool wait);
+	std::string line(const char* name, const RollingHistogram& h, const char* unit) const;
+
+	RollingHistogram m_cpu, m_gpu, m_present, m_ticks;
+	double m_start;
+	double m_idle;
+	double m_lastPresent;
+	unsigned m_tick;
+	bool m_first;
+	GpuQueries* m_queries; ///< NULL without timer queries
+};
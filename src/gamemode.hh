@@ -90,6 +90,7 @@ class GameMode {
 	}
 
 	std::string getName() const { return name; }
+	int roundsLeft() const { return rounds; }
 	double timeLeft() const { return round_timer(); }
 	int getScoreLimit() const { return scorelimit; }
 	float getRespawnDelay() const { return spawn_delay_player; }
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stdint.h>
+
+/// Input state of a single client tick. Buttons are held states,
+/// events are edge-triggered and only present in the frame they happened.
+struct InputFrame {
+	enum Button { LEFT = 1, RIGHT = 2, UP = 4, DOWN = 8 };
+	enum Event { ACTION = 1, STOP_MOVING = 2, STOP_JUMPING = 4 };
+	InputFrame(uint16_t seq = 0): seq(seq), buttons(0), events(0), view(0) { }
+	bool empty() const { return !buttons && !events; }
+	uint16_t seq;
+	uint8_t buttons;
+	uint8_t events;
+	uint16_t view; ///< Low bits of the newest state tick the client had, 0 if none
+};
@@ -0,0 +1,157 @@
+#include <algorithm>
+#include <iterator>
+#include <stdexcept>
+
+#include "inputlog.hh"
+#include "world.hh"
+#include "replay.hh"
+#include "filesystem.hh"
+
+namespace {
+	static const char MAGIC[] = { 'T', 'M', 'I', 'N' };
+	static const uint16_t FORMAT_VERSION = 1;
+	static const size_t RECORD_HEADER_SIZE = 5;
+
+	void putU16(std::vector<char>& out, uint16_t v) {
+		out.push_back(char(v & 0xFF));
+		out.push_back(char(v >> 8));
+	}
+
+	void putU32(std::vector<char>& out, uint32_t v) {
+		for (int i = 0; i < 4; ++i) out.push_back(char(v >> (i * 8)));
+	}
+
+	uint16_t getU16(const char* p) {
+		const unsigned char* u = reinterpret_cast<const unsigned char*>(p);
+		return u[0] | (u[1] << 8);
+	}
+
+	uint32_t getU32(const char* p) {
+		const unsigned char* u = reinterpret_cast<const unsigned char*>(p);
+		return u[0] | (u[1] << 8) | (u[2] << 16) | (uint32_t(u[3]) << 24);
+	}
+
+	/// Payload bytes after the record header, 0 for an unknown type
+	size_t payloadSize(char type) {
+		switch (type) {
+			case INPUTLOG_SPAWN: return 4;
+			case INPUTLOG_REMOVE: return 2;
+			case INPUTLOG_INPUT: return 8;
+			case INPUTLOG_END: return 4;
+			default: return 0;
+		}
+	}
+}
+
+
+InputLogWriter::InputLogWriter(const std::string& filename, const World& world, const std::string& gamemode):
+  m_file(filename.c_str(), std::ios::binary)
+{
+	if (!m_file) throw std::runtime_error("Cannot write input log " + filename);
+	std::vector<char> header(MAGIC, MAGIC + sizeof(MAGIC));
+	putU16(header, FORMAT_VERSION);
+	putU32(header, world.getLevelSeed());
+	putU16(header, world.getWidth());
+	putU16(header, world.getHeight());
+	std::string name = gamemode.substr(0, 255);
+	header.push_back(char(name.size()));
+	header.insert(header.end(), name.begin(), name.end());
+	m_file.write(&header[0], header.size());
+}
+
+
+void InputLogWriter::spawn(uint32_t tick, const Actor& actor, int character) {
+	m_buf.clear();
+	putU16(m_buf, actor.id);
+	m_buf.push_back(char(actor.type));
+	m_buf.push_back(char(character));
+	write(INPUTLOG_SPAWN, tick, m_buf);
+}
+
+
+void InputLogWriter::remove(uint32_t tick, const Actor& actor) {
+	m_buf.clear();
+	putU16(m_buf, actor.id);
+	write(INPUTLOG_REMOVE, tick, m_buf);
+}
+
+
+void InputLogWriter::input(uint32_t tick, const Actor& actor, const InputFrame& f, uint32_t view_tick) {
+	if (f.empty()) return;
+	m_buf.clear();
+	putU16(m_buf, actor.id);
+	m_buf.push_back(char(f.buttons));
+	m_buf.push_back(char(f.events));
+	putU32(m_buf, view_tick);
+	write(INPUTLOG_INPUT, tick, m_buf);
+}
+
+
+void InputLogWriter::end(const World& world) {
+	m_buf.clear();
+	putU32(m_buf, world.getStateHash());
+	write(INPUTLOG_END, world.getTick(), m_buf);
+	m_file.flush();
+}
+
+
+void InputLogWriter::write(char type, uint32_t tick, const std::vector<char>& payload) {
+	char header[RECORD_HEADER_SIZE] = { type };
+	for (int i = 0; i < 4; ++i) header[1 + i] = char(tick >> (i * 8));
+	m_file.write(header, sizeof(header));
+	m_file.write(&payload[0], payload.size());
+}
+
+
+InputLogReader::InputLogReader(const std::string& filename): m_seed(0), m_width(0), m_height(0) {
+	std::ifstream file(filename.c_str(), std::ios::binary);
+	if (!file) throw std::runtime_error("Cannot open input log " + filename);
+	std::vector<char> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	if (data.size() < 15 || !std::equal(MAGIC, MAGIC + sizeof(MAGIC), data.begin()))
+		throw std::runtime_error(filename + " is not an input log");
+	if (getU16(&data[4]) != FORMAT_VERSION)
+		throw std::runtime_error(filename + " was recorded with an incompatible version");
+	m_seed = getU32(&data[6]);
+	m_width = getU16(&data[10]);
+	m_height = getU16(&data[12]);
+	size_t pos = 15 + uint8_t(data[14]);
+	if (pos > data.size()) throw std::runtime_error(filename + " is truncated");
+	m_gamemode.assign(data.begin() + 15, data.begin() + pos);
+	// A truncated record at the end is ignored, like in replays
+	while (pos + RECORD_HEADER_SIZE <= data.size()) {
+		InputLogRecord r;
+		r.type = data[pos];
+		r.tick = getU32(&data[pos + 1]);
+		size_t size = payloadSize(r.type);
+		if (!size) throw std::runtime_error(filename + " has an unknown record");
+		if (pos + RECORD_HEADER_SIZE + size > data.size()) break;
+		const char* p = &data[pos + RECORD_HEADER_SIZE];
+		pos += RECORD_HEADER_SIZE + size;
+		switch (r.type) {
+			case INPUTLOG_SPAWN:
+				r.id = getU16(p);
+				r.actor = p[2];
+				r.character = p[3];
+				break;
+			case INPUTLOG_REMOVE:
+				r.id = getU16(p);
+				break;
+			case INPUTLOG_INPUT:
+				r.id = getU16(p);
+				r.input.buttons = p[2];
+				r.input.events = p[3];
+				r.view_tick = getU32(p + 4);
+				break;
+			case INPUTLOG_END:
+				r.hash = getU32(p);
+				break;
+		}
+		m_records.push_back(r);
+		if (r.type == INPUTLOG_END) break;
+	}
+}
+
+
+std::string inputLogFilename() {
+	return fs::path(replayFilename()).replace_extension(".inputs").string();
+}
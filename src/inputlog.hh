@@ -0,0 +1,85 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <stdint.h>
+#include <boost/noncopyable.hpp>
+
+#include "input.hh"
+
+class World;
+class Actor;
+
+/// Input log layout, all integers little-endian:
+///   "TMIN", format version (u16), level seed (u32), world width and height (u16),
+///   game mode file name length (u8) and the name
+///   records of type (u8), tick (u32) and a payload depending on the type:
+///     spawn: actor id (u16), actor type (u8), character (u8)
+///     remove: actor id (u16)
+///     input: actor id (u16), buttons (u8), events (u8), view tick (u32)
+///     end: state hash (u32)
+/// A deterministic master fed the same records at the same ticks plays the
+/// match again, given the same settings. Unlike a replay nothing of the world
+/// itself is stored, so the log is small enough to check in.
+enum InputLogType { INPUTLOG_SPAWN = 1, INPUTLOG_REMOVE, INPUTLOG_INPUT, INPUTLOG_END };
+
+struct InputLogRecord {
+	InputLogRecord(): type(0), tick(0), id(0), actor(0), character(0), view_tick(0), hash(0) { }
+	char type;
+	uint32_t tick;      ///< Applied before this tick is simulated
+	uint16_t id;
+	uint8_t actor;      ///< Actor::Type
+	uint8_t character;
+	InputFrame input;
+	uint32_t view_tick;
+	uint32_t hash;
+};
+
+
+/// Records what players did to a deterministic world, from the simulation thread
+class InputLogWriter: public boost::noncopyable {
+  public:
+	InputLogWriter(const std::string& filename, const World& world, const std::string& gamemode);
+
+	void spawn(uint32_t tick, const Actor& actor, int character);
+	void remove(uint32_t tick, const Actor& actor);
+	/// Empty frames change nothing and are left out
+	void input(uint32_t tick, const Actor& actor, const InputFrame& f, uint32_t view_tick);
+	/// Close the log with the final state hash, to check playbacks against
+	void end(const World& world);
+
+  private:
+	void write(char type, uint32_t tick, const std::vector<char>& payload);
+
+	std::ofstream m_file;
+	std::vector<char> m_buf;
+};
+
+/// Name for a new input log, next to the replay of the same match
+std::string inputLogFilename();
+
+
+/// Loads an input log for playing it back
+class InputLogReader: public boost::noncopyable {
+  public:
+	typedef std::vector<InputLogRecord> Records;
+
+	InputLogReader(const std::string& filename);
+
+	uint32_t seed() const { return m_seed; }
+	int width() const { return m_width; }
+	int height() const { return m_height; }
+	const std::string& gamemode() const { return m_gamemode; }
+	/// In tick order, the end record last if the log was closed
+	const Records& records() const { return m_records; }
+	/// Tick the recording stopped at, the last record's if it was not closed
+	uint32_t lastTick() const { return m_records.empty() ? 0 : m_records.back().tick; }
+	bool finished() const { return !m_records.empty() && m_records.back().type == INPUTLOG_END; }
+
+  private:
+	uint32_t m_seed;
+	int m_width, m_height;
+	std::string m_gamemode;
+	Records m_records;
+};
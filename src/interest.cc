@@ -0,0 +1,78 @@
+#include <algorithm>
+#include <Box2D.h>
+
+#include "interest.hh"
+#include "settings.hh"
+
+namespace {
+	static const float ACTOR_PRIORITY = 1.0f;
+	static const float CRATE_PRIORITY = 0.5f;
+	static const float IDLE_FACTOR = 0.25f; // Resting entities change rarely
+
+	/// Priority gained per tick, zero when out of range
+	float weight(const b2Vec2& eye, const WorldSnapshot::Item& item, float base) {
+		float dist = (item.pos - eye).Length();
+		if (dist > config_net_radius) return 0.0f;
+		float w = base * (1.0f - 0.75f * dist / config_net_radius);
+		if (item.idle) w *= IDLE_FACTOR;
+		return w;
+	}
+
+	/// Candidate for the snapshot budget
+	struct Candidate {
+		Candidate(float* acc, char* send): acc(acc), send(send) { }
+		bool operator<(const Candidate& other) const { return *acc > *other.acc; }
+		float* acc;
+		char* send;
+	};
+}
+
+
+void Interest::carry(const std::vector<WorldSnapshot::Item>& items, Accumulators& acc, Accumulators& scratch) {
+	// Snapshots list entities by increasing id, so one pass matches them up
+	scratch.resize(items.size());
+	size_t j = 0;
+	for (size_t i = 0; i < items.size(); ++i) {
+		uint16_t id = items[i].record.id;
+		while (j < acc.size() && acc[j].first < id) ++j;
+		scratch[i] = std::make_pair(id, j < acc.size() && acc[j].first == id ? acc[j].second : 0.0f);
+	}
+	acc.swap(scratch);
+}
+
+
+void Interest::prioritize(const WorldSnapshot& snapshot) {
+	const std::vector<WorldSnapshot::Item>& actors = snapshot.actors;
+	const std::vector<WorldSnapshot::Item>& crates = snapshot.crates;
+	carry(actors, m_actors, m_scratch);
+	carry(crates, m_crates, m_scratch);
+	m_sendActor.assign(actors.size(), 0);
+	m_sendCrate.assign(crates.size(), 0);
+	m_hideActor.assign(actors.size(), 0);
+	b2Vec2 eye(0, 0);
+	for (size_t i = 0; i < actors.size(); ++i)
+		if (actors[i].owner == viewer) eye = actors[i].pos;
+
+	std::vector<Candidate> candidates;
+	for (size_t i = 0; i < actors.size(); ++i) {
+		const WorldSnapshot::Item& a = actors[i];
+		m_hideActor[i] = (a.invisible && a.owner != viewer);
+		// Own actor and the hidden marker of invisible ones always go out
+		if (a.owner == viewer || a.invisible || !viewer) { m_sendActor[i] = 1; m_actors[i].second = 0; continue; }
+		m_actors[i].second += weight(eye, a, ACTOR_PRIORITY);
+		if (m_actors[i].second > 0) candidates.push_back(Candidate(&m_actors[i].second, &m_sendActor[i]));
+	}
+	for (size_t i = 0; i < crates.size(); ++i) {
+		if (!viewer) { m_sendCrate[i] = 1; continue; }
+		m_crates[i].second += weight(eye, crates[i], CRATE_PRIORITY);
+		if (m_crates[i].second > 0) candidates.push_back(Candidate(&m_crates[i].second, &m_sendCrate[i]));
+	}
+
+	// Send the most starved ones within the budget
+	size_t budget = std::min<size_t>(std::max(config_net_budget, 0), candidates.size());
+	std::partial_sort(candidates.begin(), candidates.begin() + budget, candidates.end());
+	for (size_t i = 0; i < budget; ++i) {
+		*candidates[i].acc = 0;
+		*candidates[i].send = 1;
+	}
+}
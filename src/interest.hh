@@ -0,0 +1,43 @@
+#pragma once
+
+#include <vector>
+#include <utility>
+#include <stdint.h>
+
+#include "snapshot.hh"
+
+class Actor;
+
+/// Per-client interest management. Decides which dynamic entities are
+/// relevant enough to be included in the next snapshot for one client.
+/// Every entity accumulates priority each tick depending on its distance
+/// to the client's actor and whether it moves; the highest ones are sent
+/// within a fixed per-snapshot budget and their accumulators reset.
+class Interest {
+  public:
+	Interest(const Actor* viewer = NULL): viewer(viewer) { }
+
+	/// Accumulate priorities for this tick and select the entities to send
+	void prioritize(const WorldSnapshot& snapshot);
+
+	bool actorRelevant(size_t i) const { return i < m_sendActor.size() && m_sendActor[i]; }
+	bool crateRelevant(size_t i) const { return i < m_sendCrate.size() && m_sendCrate[i]; }
+	/// Invisible actors are only sent as a marker without position
+	bool actorHidden(size_t i) const { return i < m_hideActor.size() && m_hideActor[i]; }
+
+	const Actor* viewer; ///< Client's own actor, always relevant
+
+  private:
+	/// Priority by entity id, in snapshot order
+	typedef std::vector<std::pair<uint16_t, float> > Accumulators;
+
+	/// Carry the priorities of the entities still in the snapshot over to their new positions
+	static void carry(const std::vector<WorldSnapshot::Item>& items, Accumulators& acc, Accumulators& scratch);
+
+	Accumulators m_actors; ///< Entities come and go, so positions don't identify them
+	Accumulators m_crates;
+	Accumulators m_scratch;
+	std::vector<char> m_sendActor; ///< Selection of the latest prioritize()
+	std::vector<char> m_sendCrate;
+	std::vector<char> m_hideActor;
+};
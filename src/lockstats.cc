@@ -0,0 +1,124 @@
+#include <vector>
+#include <iomanip>
+#include <algorithm>
+
+#include "lockstats.hh"
+
+std::atomic<bool> LockStats::s_active(false);
+
+namespace {
+	#ifdef USE_THREADS
+	boost::mutex registry_mutex;
+	#endif
+	std::vector<const LockSite*> sites;
+
+	int bucket(uint64_t ns) {
+		int b = 0;
+		while (ns > 1 && b < LockSite::BUCKETS - 1) { ns >>= 1; ++b; }
+		return b;
+	}
+
+	void raise(std::atomic<uint64_t>& max, uint64_t v) {
+		uint64_t cur = max.load(std::memory_order_relaxed);
+		while (v > cur && !max.compare_exchange_weak(cur, v, std::memory_order_relaxed)) { }
+	}
+
+	/// Upper bound of the bucket holding the given share of the samples, in microseconds
+	double percentile(const std::atomic<uint64_t>* hist, double p) {
+		uint64_t total = 0;
+		for (int i = 0; i < LockSite::BUCKETS; ++i) total += hist[i];
+		uint64_t rank = uint64_t(p / 100.0 * total + 0.5), seen = 0;
+		for (int i = 0; i < LockSite::BUCKETS; ++i) {
+			seen += hist[i];
+			if (seen >= rank && seen > 0) return (uint64_t(2) << i) / 1000.0;
+		}
+		return 0.0;
+	}
+
+	std::string duration(uint64_t ns) {
+		if (ns < 1000) return std::to_string(ns) + "ns";
+		if (ns < 1000000) return std::to_string(ns / 1000) + "us";
+		return std::to_string(ns / 1000000) + "ms";
+	}
+
+	/// Non-empty buckets as upper bound:count
+	void histogram(std::ostream& os, const char* what, const std::atomic<uint64_t>* hist) {
+		os << "  " << what << ":";
+		for (int i = 0; i < LockSite::BUCKETS; ++i)
+			if (hist[i]) os << " <" << duration(uint64_t(2) << i) << ":" << hist[i];
+		os << std::endl;
+	}
+
+	std::string name(const LockSite& s) {
+		std::string file(s.file);
+		return std::string(s.function) + " " + file.substr(file.find_last_of("/\\") + 1) + ":" + std::to_string(s.line);
+	}
+
+	bool busier(const LockSite* a, const LockSite* b) {
+		return a->wait_total + a->hold_total > b->wait_total + b->hold_total;
+	}
+}
+
+
+LockSite::LockSite(const char* function, const char* file, int line):
+  function(function), file(file), line(line), acquisitions(0), contended(0),
+  wait_total(0), hold_total(0), wait_max(0), hold_max(0)
+{
+	for (int i = 0; i < BUCKETS; ++i) { wait[i] = 0; hold[i] = 0; }
+	#ifdef USE_THREADS
+	boost::mutex::scoped_lock lock(registry_mutex);
+	#endif
+	sites.push_back(this);
+}
+
+
+void LockSite::waited(uint64_t ns, bool was_contended) {
+	acquisitions.fetch_add(1, std::memory_order_relaxed);
+	if (was_contended) contended.fetch_add(1, std::memory_order_relaxed);
+	wait_total.fetch_add(ns, std::memory_order_relaxed);
+	wait[bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+	raise(wait_max, ns);
+}
+
+
+void LockSite::held(uint64_t ns) {
+	hold_total.fetch_add(ns, std::memory_order_relaxed);
+	hold[bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+	raise(hold_max, ns);
+}
+
+
+void LockStats::report(std::ostream& os) {
+	std::vector<const LockSite*> all;
+	{
+		#ifdef USE_THREADS
+		boost::mutex::scoped_lock lock(registry_mutex);
+		#endif
+		all = sites;
+	}
+	std::sort(all.begin(), all.end(), busier);
+	os << "Lock contention by call site, totals in ms, the rest in us" << std::endl;
+	os << std::left << std::setw(34) << "site" << std::right << std::setw(10) << "count" << std::setw(10) << "contended"
+	  << std::setw(10) << "wait" << std::setw(9) << "p50" << std::setw(9) << "p99" << std::setw(10) << "max"
+	  << std::setw(10) << "hold" << std::setw(9) << "p50" << std::setw(9) << "p99" << std::setw(10) << "max" << std::endl;
+	os << std::fixed;
+	for (size_t i = 0; i < all.size(); ++i) {
+		const LockSite& s = *all[i];
+		if (!s.acquisitions) continue;
+		os << std::left << std::setw(34) << name(s) << std::right << std::setw(10) << s.acquisitions << std::setw(10) << s.contended
+		  << std::setprecision(2) << std::setw(10) << s.wait_total / 1e6
+		  << std::setprecision(1) << std::setw(9) << percentile(s.wait, 50) << std::setw(9) << percentile(s.wait, 99)
+		  << std::setw(10) << s.wait_max / 1e3
+		  << std::setprecision(2) << std::setw(10) << s.hold_total / 1e6
+		  << std::setprecision(1) << std::setw(9) << percentile(s.hold, 50) << std::setw(9) << percentile(s.hold, 99)
+		  << std::setw(10) << s.hold_max / 1e3 << std::endl;
+	}
+	for (size_t i = 0; i < all.size(); ++i) {
+		const LockSite& s = *all[i];
+		if (!s.acquisitions) continue;
+		os << name(s) << std::endl;
+		histogram(os, "wait", s.wait);
+		histogram(os, "hold", s.hold);
+	}
+	os.unsetf(std::ios::fixed);
+}
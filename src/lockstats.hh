@@ -0,0 +1,82 @@
+#pragma once
+
+#include "config.hh"
+
+#include <iostream>
+#include <atomic>
+#include <stdint.h>
+#ifdef USE_THREADS
+#include <boost/thread/mutex.hpp>
+#endif
+
+#include "profiler.hh"
+
+/// Acquisitions, wait and hold times of one place taking a lock. Times go
+/// into power of two histograms of nanoseconds, updated without locking.
+class LockSite {
+  public:
+	static const int BUCKETS = 32;
+
+	/// Registers itself, sites are function statics and live forever
+	LockSite(const char* function, const char* file, int line);
+
+	void waited(uint64_t ns, bool contended);
+	void held(uint64_t ns);
+
+	const char* function;
+	const char* file;
+	int line;
+	std::atomic<uint64_t> acquisitions;
+	std::atomic<uint64_t> contended; ///< Had to wait for another thread
+	std::atomic<uint64_t> wait_total, hold_total;
+	std::atomic<uint64_t> wait_max, hold_max;
+	std::atomic<uint64_t> wait[BUCKETS], hold[BUCKETS]; ///< Bucket i counts times below 2^(i+1) ns
+};
+
+
+/// Lock contention statistics of all sites, off unless started
+class LockStats {
+  public:
+	static void start() { s_active = true; }
+	static bool active() { return s_active.load(std::memory_order_relaxed); }
+	/// Table of all sites, the busiest first, and their histograms
+	static void report(std::ostream& os);
+
+  private:
+	static std::atomic<bool> s_active;
+};
+
+
+#ifdef USE_THREADS
+/// Takes a deferred lock, timing the wait and, until it goes out of scope,
+/// the hold. Declare it after the lock so that it ends first.
+class TimedLock {
+  public:
+	TimedLock(boost::mutex::scoped_lock& lock, LockSite& site): m_lock(lock), m_site(site), m_acquired(0) {
+		if (!LockStats::active()) { lock.lock(); return; }
+		uint64_t start = Profiler::now();
+		bool contended = !lock.try_lock();
+		if (contended) lock.lock();
+		m_acquired = Profiler::now();
+		site.waited(m_acquired - start, contended);
+	}
+	~TimedLock() { if (m_acquired) m_site.held(Profiler::now() - m_acquired); }
+  private:
+	TimedLock(const TimedLock&);
+	TimedLock& operator=(const TimedLock&);
+	boost::mutex::scoped_lock& m_lock;
+	LockSite& m_site;
+	uint64_t m_acquired;
+};
+
+/// Lock a mutex into a scoped_lock named lock, timed per call site when
+/// profiling is compiled in
+#ifdef USE_PROFILER
+#define TIMED_LOCK(mtx) \
+	static LockSite lock_site(__func__, __FILE__, __LINE__); \
+	boost::mutex::scoped_lock lock(mtx, boost::defer_lock); \
+	TimedLock timed_lock(lock, lock_site)
+#else
+#define TIMED_LOCK(mtx) boost::mutex::scoped_lock lock(mtx)
+#endif
+#endif
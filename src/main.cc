@@ -2,6 +2,7 @@
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <iomanip>
 #include <string>
 #include <stdexcept>
 #include <cstdio>
@@ -27,14 +28,44 @@
 #include "keys.hh"
 #include "texture.hh"
 #include "gamemode.hh"
+#include "replay.hh"
+#include "selfplay.hh"
+#include "inputlog.hh"
+#include "benchmark.hh"
+#include "profiler.hh"
+#include "lockstats.hh"
+#include "frametimes.hh"
 
 #define WW 25.0
 #define WH (WW*scrH/scrW)
 
 static bool QUIT = false;
+static bool NETSTATS = false;
+static bool FRAMETIMES = false;
+static std::string GAMEMODE; ///< File name, for input logs
+static std::string PROFILE_FILE; ///< Trace written on exit, see --profile
+
+/// Start profiling, or write what was recorded and stop
+void toggle_profiler() {
+	#ifdef USE_PROFILER
+	if (!Profiler::active()) {
+		Profiler::start();
+		std::cout << "Profiling, press F4 again to write the trace." << std::endl;
+		return;
+	}
+	Profiler::stop();
+	std::string filename = Profiler::traceFilename();
+	size_t zones = Profiler::dump(filename);
+	std::cout << "Wrote " << zones << " profiler zones to " << filename << std::endl;
+	#else
+	std::cout << "Profiling is disabled in this build." << std::endl;
+	#endif
+}
 
 /// Keyboard input
-void update_keys(Players& players) {
+void update_keys(World& world) {
+	Players& players = world.getActors();
+	PROFILE("events");
 	SDL_Event event;
 	while(SDL_PollEvent(&event)) {
 		switch(event.type) {
@@ -43,12 +74,18 @@ void update_keys(Players& players) {
 		case SDL_KEYDOWN: {
 			int k = event.key.keysym.sym;
 			if (k == SDLK_ESCAPE) { QUIT = true; return; }
+			if (k == SDLK_F3) { NETSTATS = !NETSTATS; break; }
+			if (k == SDLK_F6) { FRAMETIMES = !FRAMETIMES; break; }
+			if (k == SDLK_F4) { toggle_profiler(); break; }
+			if (k == SDLK_F5 && LockStats::active()) { LockStats::report(std::cout); break; }
+			World::Roster roster(world);
 			for (Players::iterator it = players.begin(); it != players.end(); ++it)
 				it->key_state(k, true);
 			break;
 			}
 		case SDL_KEYUP: {
 			int k = event.key.keysym.sym;
+			World::Roster roster(world);
 			for (Players::iterator it = players.begin(); it != players.end(); ++it)
 				it->key_state(k, false);
 			break;
@@ -76,19 +113,52 @@ void setup_gl() {
 	glEnable(GL_LINE_SMOOTH);
 }
 
+#ifdef USE_NETWORK
+/// Network statistics overlay
+void draw_netstats(Font& f, const NetStats& s) {
+	std::ostringstream oss;
+	oss << std::fixed << std::setprecision(1);
+	oss << "RTT " << s.rtt << " ms, jitter " << s.jitter << " ms, loss " << s.loss << " %";
+	f.drawText(10, 30, oss.str());
+	oss.str("");
+	oss << "Up " << s.sent.get() / 1024.0 << " kB/s, down " << s.received.get() / 1024.0 << " kB/s";
+	f.drawText(10, 50, oss.str());
+	oss.str("");
+	oss << "Snapshot " << s.snapshot.total() << " B: actors " << s.snapshot.actors << ", crates " << s.snapshot.crates
+	  << ", powerups " << s.snapshot.powerups << ", static " << s.snapshot.statics;
+	f.drawText(10, 70, oss.str());
+	oss.str("");
+	oss << std::setprecision(3) << "Decode " << s.decode_ms << " ms";
+	f.drawText(10, 90, oss.str());
+	oss.str("");
+	oss << std::setprecision(1) << "Clock offset " << s.clock_offset << " ms, drift " << s.clock_drift << " ppm";
+	f.drawText(10, 110, oss.str());
+}
+#endif
+
 /// Thread functions
 
 #ifdef USE_THREADS
-void doKeys(Players& players) {
+void doKeys(World& world) {
+	Profiler::nameThread("input");
+	Players& players = world.getActors();
 	while (!QUIT) {
-		for (Players::iterator it = players.begin(); it != players.end(); ++it)
-			it->handle_keys();
+		{
+			PROFILE("keys");
+			World::Roster roster(world);
+			for (Players::iterator it = players.begin(); it != players.end(); ++it)
+				it->handle_keys();
+		}
 		boost::this_thread::sleep(boost::posix_time::milliseconds(10));
 	}
 
 }
-void updateWorld(World& world) { while (!QUIT) { world.update(); } }
+void updateWorld(World& world) {
+	Profiler::nameThread("physics");
+	while (!QUIT && !world.gameOver()) { world.update(); }
+}
 void updateViewport(World& world) {
+	Profiler::nameThread("viewport");
 	while (!QUIT) {
 		world.updateViewport();
 		boost::this_thread::sleep(boost::posix_time::milliseconds(15));
@@ -111,6 +181,7 @@ struct SDLContainer {
 	~SDLContainer() { SDL_Quit(); }
 
 	void flip() {
+		PROFILE("swap");
 		SDL_GL_SwapWindow(window);
 		glClear(GL_COLOR_BUFFER_BIT);
 		glLoadIdentity();
@@ -120,13 +191,36 @@ struct SDLContainer {
 	SDL_Window* window;
 };
 
+/// Log the input of a deterministic master, before any actors join
+void startInputLog(World& world, boost::scoped_ptr<InputLogWriter>& inputs) {
+	if (!config_replay_inputs || !world.isDeterministic()) return;
+	try {
+		inputs.reset(new InputLogWriter(inputLogFilename(), world, GAMEMODE));
+		world.setInputLog(inputs.get());
+	} catch (std::exception& e) {
+		std::cout << "-!- Not logging input: " << e.what() << std::endl;
+	}
+}
+
+/// Record the game if enabled, playing on without a recording if that fails
+void startRecorder(World& world, boost::scoped_ptr<ReplayWriter>& recorder) {
+	if (!config_replay_record) return;
+	try {
+		recorder.reset(new ReplayWriter(replayFilename(), world, config_replay_keyframe));
+		world.setRecorder(recorder.get());
+	} catch (std::exception& e) {
+		std::cout << "-!- Not recording: " << e.what() << std::endl;
+	}
+}
+
 /// Game loop
-bool main_loop(GameMode gm, int num_players_local, int num_players_ai, bool is_client, std::string host, int port) {
+bool main_loop(GameMode gm, int num_players_local, int num_players_ai, bool is_client, bool spectate, std::string host, int port) {
 	SDLContainer sdl; // Initialize SDL, automatic deinit
 	setup_gl();
 	TextureMap tm = load_textures();
 	World world(WW, WH, tm, gm, !is_client);
 	Players& players = world.getActors();
+	boost::scoped_ptr<InputLogWriter> inputs;
 
 	// Load font
 	Font f(getFilePath("fonts/FreeSerifBold.ttf"), 16);
@@ -141,30 +235,37 @@ bool main_loop(GameMode gm, int num_players_local, int num_players_ai, bool is_c
 	Client client(&world);
 
 	if (is_client) {
-		client.connect(host, port);
+		client.connect(host, port, spectate ? ROLE_SPECTATOR : ROLE_PLAYER);
 		std::cout << "Connected to " << host << ":" << port << std::endl;
 		std::cout << "Waiting for players..." << std::endl;
-		while (true) {
-			boost::this_thread::sleep(boost::posix_time::milliseconds(500));
-			if (players.size() >= 2) break;
-		}
+		world.waitForActors(2);
 	} else {
 	#else
 	if (true) {
 	#endif
+		startInputLog(world, inputs);
 		for (int i = 0; i < num_players_local + num_players_ai; ++i) {
-			b2Vec2 pos = world.randomSpawnLocked();
-			world.addActor(pos.x, pos.y, i >= num_players_local ? Actor::AI : Actor::HUMAN, (i % 4) + 1);
+			world.spawnActor(i >= num_players_local ? Actor::AI : Actor::HUMAN, (i % 4) + 1);
 		}
 	}
 
 	parse_keys(players, getFilePath("config/keys.conf"));
 
+	// Clients don't simulate, the server records
+	boost::scoped_ptr<ReplayWriter> recorder;
+	if (!is_client) startRecorder(world, recorder);
+
 	while (titletime > GetSecs()); // Ensure title visibility
 
+	NETSTATS = config_netstats;
+	FRAMETIMES = config_frametimes;
+
 	// Launch threads
+	// Deterministic worlds read the keys themselves at tick boundaries
+	bool own_keys = !world.isDeterministic();
 	#ifdef USE_THREADS
-	boost::thread thread_input(doKeys, boost::ref(players));
+	boost::thread thread_input;
+	if (own_keys) thread_input = boost::thread(doKeys, boost::ref(world));
 	boost::thread thread_physics(updateWorld, boost::ref(world));
 	boost::thread thread_viewport;
 	if (config_zoom) thread_viewport = boost::thread(updateViewport, boost::ref(world));
@@ -173,19 +274,24 @@ bool main_loop(GameMode gm, int num_players_local, int num_players_ai, bool is_c
 	// MAIN LOOP
 	std::cout << "Game started." << std::endl;
 	FPS fps;
+	FrameTimes frames;
 	while (!QUIT) {
+		if (world.gameOver()) QUIT = true;
 		fps.update();
 		if ((int(GetSecs()*1000) % 500) == 0) fps.debugPrint();
+		frames.begin(world.getTick());
 
-		update_keys(players);
+		update_keys(world);
 
 		#if !defined(USE_THREADS)
-		doKeys(players);
+		if (own_keys) doKeys(world);
 		world.update();
 		if (config_zoom) world.updateViewport();
 		#else
 		/// max 100 FPS
+		double idle_start = GetPreciseSecs();
 		boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+		frames.idle(GetPreciseSecs() - idle_start);
 		#endif
 
 		// Render world
@@ -194,51 +300,179 @@ bool main_loop(GameMode gm, int num_players_local, int num_players_ai, bool is_c
 		// Draw UI
 		glEnable(GL_TEXTURE_2D);
 		std::ostringstream oss; int i = 1;
-		for (Players::const_iterator it = players.begin(); it != players.end(); ++it, ++i)
-			oss << it->getName() << ": " << it->points.round_score << "   ";
+		{
+			World::Roster roster(world);
+			for (Players::const_iterator it = players.begin(); it != players.end(); ++it, ++i)
+				oss << it->getName() << ": " << it->points.round_score << "   ";
+		}
 		glColor4f(1.0f,0.0f,0.0f,0.75f);
 		f.out(10, 10) << oss.str() << f.end();
+		#ifdef USE_NETWORK
+		if (is_client && NETSTATS) {
+			glColor4f(1.0f,1.0f,1.0f,0.75f);
+			draw_netstats(f, client.getStats());
+		}
+		#endif
+		if (FRAMETIMES) {
+			glColor4f(1.0f,1.0f,1.0f,0.75f);
+			frames.draw(f, 10, scrH - 90);
+		}
 
 		// Flip
+		frames.end();
 		sdl.flip();
+		frames.presented();
 	}
 	#ifdef USE_NETWORK
 	if (is_client) client.terminate();
 	#endif
 	#ifdef USE_THREADS
-	thread_input.join();
+	if (own_keys) thread_input.join();
 	thread_physics.join();
 	if (config_zoom) thread_viewport.join();
 	#endif
+	world.setRecorder(NULL);
+	if (inputs) inputs->end(world);
+	world.setInputLog(NULL);
 	return false;
 }
 
+/// Replay playback
+void replay_loop(GameMode gm, std::string filename) {
+	ReplayReader replay(filename);
+	SDLContainer sdl; // Initialize SDL, automatic deinit
+	setup_gl();
+	TextureMap tm = load_textures();
+	World world(WW, WH, tm, gm, false);
+	Font f(getFilePath("fonts/FreeSerifBold.ttf"), 16);
+	if (!replay.level().empty()) world.update(&replay.level()[0], replay.level().size());
+
+	std::cout << "Replay: Left/Right seek, Up/Down speed, Space pause, Esc quit." << std::endl;
+	double tick = replay.firstTick(), speed = 1.0;
+	bool paused = false;
+	double prev = GetSecs();
+	while (!QUIT) {
+		SDL_Event event;
+		while (SDL_PollEvent(&event)) {
+			if (event.type == SDL_QUIT) QUIT = true;
+			if (event.type != SDL_KEYDOWN) continue;
+			switch (event.key.keysym.sym) {
+				case SDLK_ESCAPE: QUIT = true; break;
+				case SDLK_SPACE: paused = !paused; break;
+				case SDLK_UP: speed = std::min(speed * 2.0, 16.0); break;
+				case SDLK_DOWN: speed = std::max(speed * 0.5, 0.125); break;
+				// Back to the previous keyframe, or the one before it if just past one
+				case SDLK_LEFT: tick = replay.prevKeyframe(std::max<int>(replay.tick() - REPLAY_TICKRATE / 2, 0)); break;
+				case SDLK_RIGHT: tick = replay.nextKeyframe(replay.tick()); break;
+				case SDLK_HOME: tick = replay.firstTick(); break;
+			}
+		}
+		double now = GetSecs();
+		if (!paused) tick = std::min<double>(tick + (now - prev) * REPLAY_TICKRATE * speed, replay.lastTick());
+		prev = now;
+		replay.seek(world, tick);
+		if (config_zoom) world.updateViewport();
+
+		world.draw();
+		glEnable(GL_TEXTURE_2D);
+		std::ostringstream oss;
+		Players& players = world.getActors();
+		for (Players::const_iterator it = players.begin(); it != players.end(); ++it)
+			oss << it->getName() << ": " << it->points.round_score << "   ";
+		glColor4f(1.0f,0.0f,0.0f,0.75f);
+		f.out(10, 10) << oss.str() << f.end();
+		oss.str("");
+		oss << std::fixed << std::setprecision(1) << "Replay " << (replay.tick() - replay.firstTick()) / double(REPLAY_TICKRATE)
+		  << " / " << (replay.lastTick() - replay.firstTick()) / double(REPLAY_TICKRATE) << " s, "
+		  << std::setprecision(3) << speed << "x" << (paused ? ", paused" : "");
+		glColor4f(1.0f,1.0f,1.0f,0.75f);
+		f.drawText(10, scrH - 30, oss.str());
+		sdl.flip();
+		SDL_Delay(10);
+	}
+}
+
 /// Server runs here
 void server_loop(GameMode gm, int port) {
 #ifdef USE_NETWORK
 	TextureMap tm;
 	World world(WW, WH, tm, gm);
-	Players& players = world.getActors();
 	Server server(&world, port);
+	boost::scoped_ptr<InputLogWriter> inputs;
+	startInputLog(world, inputs);
+	boost::scoped_ptr<ReplayWriter> recorder;
+	startRecorder(world, recorder);
 
 	std::cout << "Server listening on port " << port << std::endl;
 
 	// Wait for players before starting simulation
-	while (true) {
-		boost::this_thread::sleep(boost::posix_time::milliseconds(500));
-		if (players.size() >= 2) break;
+	while (world.getActors().size() < 2) {
+		server.waitForMessages();
+		server.processMessages();
 	}
 
 	// MAIN LOOP
-	while (true) {
+	Countdown stats(config_net_statsinterval);
+	while (!world.gameOver()) {
+		// Apply what arrived from the network since the last tick
+		server.processMessages();
 		// Update world
 		world.update();
-		// Compose game-state to send to clients
-		std::string state = world.serialize();
 		// Send game state to clients
-		if (state != "") server.send(state);
+		server.sendState();
+		if (config_net_statsinterval > 0 && stats()) {
+			server.printStats(std::cout);
+			if (LockStats::active()) LockStats::report(std::cout);
+			stats = Countdown(config_net_statsinterval);
+		}
 	}
 	server.terminate();
+	if (inputs) inputs->end(world);
+	world.setInputLog(NULL);
+#endif
+}
+
+/// Bots playing each other without a window
+void selfplay_loop(GameMode gm, SelfPlayOptions options) {
+	options.width = WW;
+	options.height = WH;
+	std::cout << "Self-play: " << options.matches << " matches on each of " << std::max<size_t>(options.seeds.size(), 1)
+	  << " levels, " << options.bots << " bots, game mode " << gm.getName() << std::endl;
+	SelfPlayStats stats = selfPlay(gm, options);
+	stats.write(std::cout);
+}
+
+/// Recorded input played back headless, to time the simulation
+void benchmark_loop(std::string filename) {
+	InputLogReader log(filename);
+	GameMode gm(getFilePath("config/" + log.gamemode()));
+	std::cout << "Benchmark: " << filename << ", " << log.lastTick() << " ticks, game mode " << gm.getName() << std::endl;
+	BenchmarkStats stats = benchmark(log, gm);
+	stats.write(std::cout);
+}
+
+/// Replay seeked back through headless, to check that seeking rebuilds the world
+void replay_check_loop(GameMode gm, std::string filename) {
+	ReplayReader replay(filename);
+	TextureMap tm;
+	World world(WW, WH, tm, gm, false);
+	world.setVerbose(false);
+	if (!replay.level().empty()) world.update(&replay.level()[0], replay.level().size());
+	std::cout << "Replay check: " << filename << ", " << replay.lastTick() - replay.firstTick() << " ticks" << std::endl;
+	std::vector<uint32_t> differ = checkSeeking(replay, world);
+	std::cout << "[ReplayCheck]" << std::endl;
+	std::cout << "mismatches = " << differ.size() << std::endl;
+	if (!differ.empty()) std::cout << "first_mismatch = " << differ.front() << std::endl;
+	std::cout << "result = " << (differ.empty() ? "ok" : "mismatch") << std::endl;
+}
+
+/// Spectator relay runs here
+void relay_loop(std::string host, int port, int listen_port) {
+#ifdef USE_NETWORK
+	Relay relay(host, port, listen_port, config_relay_delay);
+	std::cout << "Relaying " << host << ":" << port << " to spectators on port " << listen_port
+	  << ", delay " << config_relay_delay << " s" << std::endl;
+	relay.run();
 #endif
 }
 
@@ -262,7 +496,10 @@ template<> bool parseVal(std::string& var, int& i, int argc, char** argv) {
 
 /// Program entry-point
 int main(int argc, char** argv) {
-	bool dedicated_server = false, client = false;
+	bool dedicated_server = false, client = false, spectate = false, relay = false, selfplay = false;
+	SelfPlayOptions selfplay_options;
+	std::string replay, replay_check, benchmark_log;
+	int listen_port = 0;
 
 	readConfig();
 
@@ -276,7 +513,7 @@ int main(int argc, char** argv) {
 		std::string arg(argv[i]);
 		if (arg == "--help" || std::string(argv[i]) == "-h") {
 			std::cout << "Usage: " << argv[0] << " "
-			  << "[--help | -h] [--players NUM] [--ai NUM] [ [--server [PORT]] | [--client [HOST] [PORT]] ]"
+			  << "[--help | -h] [--deterministic] [--profile [FILE]] [--lockstats] [--players NUM] [--ai NUM] [ [--server [PORT]] | [--client [HOST] [PORT]] | [--spectate [HOST] [PORT]] | [--relay HOST PORT [LISTENPORT]] | [--replay FILE] | [--replay-check FILE] | [--benchmark FILE] | [--selfplay [MATCHES] [--seeds SEED,...] [--threads NUM] [--limit SECONDS]] ]"
 			  << std::endl;
 			return 0;
 		}
@@ -287,7 +524,57 @@ int main(int argc, char** argv) {
 			client = true;
 			if (parseVal(host, i, argc, argv))
 				parseVal(port, i, argc, argv);
-		} else if (arg == "--players") parseVal(num_players_local, i, argc, argv);
+		} else if (arg == "--spectate") {
+			client = true;
+			spectate = true;
+			if (parseVal(host, i, argc, argv))
+				parseVal(port, i, argc, argv);
+		} else if (arg == "--relay") {
+			relay = true;
+			if (!parseVal(host, i, argc, argv) || !parseVal(port, i, argc, argv)) {
+				std::cout << "--relay needs the host and port of the server." << std::endl;
+				exit(EXIT_FAILURE);
+			}
+			parseVal(listen_port, i, argc, argv);
+		} else if (arg == "--replay") {
+			if (!parseVal(replay, i, argc, argv)) {
+				std::cout << "--replay needs a file name." << std::endl;
+				exit(EXIT_FAILURE);
+			}
+		} else if (arg == "--replay-check") {
+			if (!parseVal(replay_check, i, argc, argv)) {
+				std::cout << "--replay-check needs a file name." << std::endl;
+				exit(EXIT_FAILURE);
+			}
+		} else if (arg == "--benchmark") {
+			if (!parseVal(benchmark_log, i, argc, argv)) {
+				std::cout << "--benchmark needs an input log." << std::endl;
+				exit(EXIT_FAILURE);
+			}
+			config_deterministic = true; // The log only plays back like this
+		} else if (arg == "--selfplay") {
+			selfplay = true;
+			parseVal(selfplay_options.matches, i, argc, argv);
+		} else if (arg == "--seeds") {
+			std::string seeds;
+			parseVal(seeds, i, argc, argv);
+			std::istringstream iss(seeds);
+			for (std::string seed; std::getline(iss, seed, ',');)
+				if (!seed.empty()) selfplay_options.seeds.push_back(str2num<uint32_t>(seed));
+		} else if (arg == "--threads") parseVal(selfplay_options.threads, i, argc, argv);
+		else if (arg == "--limit") parseVal(selfplay_options.limit, i, argc, argv);
+		else if (arg == "--deterministic") config_deterministic = true;
+		else if (arg == "--lockstats") {
+			#ifdef USE_PROFILER
+			LockStats::start();
+			#else
+			std::cout << "Lock statistics are disabled in this build." << std::endl;
+			#endif
+		}
+		else if (arg == "--profile") {
+			if (!parseVal(PROFILE_FILE, i, argc, argv)) PROFILE_FILE = Profiler::traceFilename();
+		}
+		else if (arg == "--players") parseVal(num_players_local, i, argc, argv);
 		else if (arg == "--ai") parseVal(num_players_ai, i, argc, argv);
 		else if (arg == "--gamemode") parseVal(gamemode, i, argc, argv);
 		else {
@@ -296,26 +583,53 @@ int main(int argc, char** argv) {
 		}
 	}
 
-	srand(time(NULL)); // Randomize RNG
+	Rng::randomize(time(NULL)); // Randomize RNG
+
+	Profiler::nameThread("main");
+	if (!PROFILE_FILE.empty()) {
+		#ifdef USE_PROFILER
+		Profiler::start();
+		#else
+		std::cout << "Profiling is disabled in this build." << std::endl;
+		PROFILE_FILE.clear();
+		#endif
+	}
 
 	// TODO: Main menu
 
 	try {
 		if (gamemode.find(".gamemode") == std::string::npos) gamemode += ".gamemode";
 		GameMode gm(getFilePath("config/" + gamemode));
+		GAMEMODE = gamemode;
 
 		#ifndef USE_NETWORK
-		if (dedicated_server || client)
+		if (dedicated_server || client || relay)
 			throw std::runtime_error("Networking support is disabled in this build.");
 		#else
 		ENetContainer enet; // Initialize ENet, automatic deinit
 		#endif
-		if (!dedicated_server) {
-			main_loop(gm, num_players_local, num_players_ai, client, host, port);
+		if (!benchmark_log.empty()) {
+			benchmark_loop(benchmark_log);
+		} else if (!replay_check.empty()) {
+			replay_check_loop(gm, replay_check);
+		} else if (selfplay) {
+			if (num_players_ai > 0) selfplay_options.bots = num_players_ai;
+			selfplay_loop(gm, selfplay_options);
+		} else if (!replay.empty()) {
+			replay_loop(gm, replay);
+		} else if (relay) {
+			relay_loop(host, port, listen_port ? listen_port : port + 1);
+		} else if (!dedicated_server) {
+			main_loop(gm, num_players_local, num_players_ai, client, spectate, host, port);
 		} else server_loop(gm, port);
 	} catch (std::exception& e) {
 		// TODO: Nicer output
 		std::cout << "-!- FATAL ERROR: " << e.what() << std::endl;
 	}
+	if (!PROFILE_FILE.empty() && Profiler::active()) {
+		size_t zones = Profiler::dump(PROFILE_FILE);
+		std::cout << "Wrote " << zones << " profiler zones to " << PROFILE_FILE << std::endl;
+	}
+	if (LockStats::active()) LockStats::report(std::cout);
 	return 0;
 }
@@ -0,0 +1,225 @@
+#include <algorithm>
+#include <queue>
+#include <cmath>
+
+#include "nav.hh"
+#include "player.hh"
+#include "world.hh"
+
+#ifdef USE_THREADS
+	#define LOCKCACHE boost::mutex::scoped_lock lock(m_cacheMutex)
+#else
+	#define LOCKCACHE
+#endif
+
+namespace {
+	static const float ACTOR_HEIGHT = 0.5f; // Center above the surface
+	static const float JUMP_UP = 1.0f; // Highest step up a jump reliably makes
+	static const float JUMP_REACH = 2.5f; // Horizontal distance of a jump to the same height
+	static const float LADDER_REACH = 1.0f; // Platform ends this close to a ladder connect to it
+	static const float JUMP_PENALTY = 0.5f; // Jumps fail sometimes, prefer walking
+	static const size_t CACHE_SIZE = 1024; // Paths, the cache starts over when full
+
+	/// Slab test of a segment against a box
+	bool segmentHits(const b2Vec2& a, const b2Vec2& b, float x1, float y1, float x2, float y2) {
+		float t0 = 0.0f, t1 = 1.0f;
+		const float lo[] = { x1, y1 }, hi[] = { x2, y2 }, p[] = { a.x, a.y }, d[] = { b.x - a.x, b.y - a.y };
+		for (int i = 0; i < 2; ++i) {
+			if (std::abs(d[i]) < 1e-6f) {
+				if (p[i] < lo[i] || p[i] > hi[i]) return false;
+				continue;
+			}
+			float ta = (lo[i] - p[i]) / d[i], tb = (hi[i] - p[i]) / d[i];
+			if (ta > tb) std::swap(ta, tb);
+			t0 = std::max(t0, ta);
+			t1 = std::min(t1, tb);
+			if (t0 > t1) return false;
+		}
+		return true;
+	}
+
+	/// Open node in the A* search
+	struct Open {
+		Open(int node, float f): node(node), f(f) { }
+		bool operator<(const Open& other) const { return f > other.f; }
+		int node;
+		float f;
+	};
+}
+
+
+void NavGraph::clear() {
+	m_nodes.clear();
+	m_platforms.clear();
+	LOCKCACHE;
+	m_cache.clear();
+}
+
+
+void NavGraph::build(const Platforms& platforms, const Ladders& ladders, const Bridges& bridges, float water_level) {
+	clear();
+	// Nodes a tile apart on top of every platform, ends first and last
+	std::vector<int> first(platforms.size()), last(platforms.size());
+	for (size_t p = 0; p < platforms.size(); ++p) {
+		const Platform& pl = platforms[p];
+		Box box = { pl.getX() - pl.getW() * 0.5f, pl.getY() - pl.getH() * 0.5f,
+		            pl.getX() + pl.getW() * 0.5f, pl.getY() + pl.getH() * 0.5f };
+		m_platforms.push_back(box);
+		first[p] = m_nodes.size();
+		float y = box.y1 - ACTOR_HEIGHT;
+		int count = std::max(1, int(pl.getW() + 0.5f) - 1);
+		for (int i = 0; i <= count; ++i) {
+			float x = box.x1 + 0.5f + (pl.getW() - 1.0f) * i / count;
+			m_nodes.push_back(NavNode(b2Vec2(x, y), p));
+			if (i > 0) {
+				int n = m_nodes.size() - 1;
+				float cost = (m_nodes[n].pos.x - m_nodes[n-1].pos.x) / speed_move_ground;
+				link(n - 1, n, NavEdge::WALK, cost);
+				link(n, n - 1, NavEdge::WALK, cost);
+			}
+		}
+		last[p] = m_nodes.size() - 1;
+	}
+	// Bridges join the facing ends of their anchors
+	for (Bridges::const_iterator it = bridges.begin(); it != bridges.end(); ++it) {
+		if (it->leftAnchor >= platforms.size() || it->rightAnchor >= platforms.size()) continue;
+		int a = last[it->leftAnchor], b = first[it->rightAnchor];
+		float cost = (m_nodes[b].pos - m_nodes[a].pos).Length() / speed_move_ground;
+		link(a, b, NavEdge::WALK, cost);
+		link(b, a, NavEdge::WALK, cost);
+	}
+	// Ladders connect the platform ends next to them, one after another from the top
+	for (Ladders::const_iterator it = ladders.begin(); it != ladders.end(); ++it) {
+		float top = it->getY() - it->getH() * 0.5f, bottom = std::min(it->getY() + it->getH() * 0.5f, water_level);
+		std::vector<std::pair<float, int> > stops;
+		for (size_t p = 0; p < platforms.size(); ++p) {
+			int ends[] = { first[p], last[p] };
+			for (int e = 0; e < 2; ++e) {
+				const NavNode& n = m_nodes[ends[e]];
+				if (std::abs(n.pos.x - it->getX()) <= LADDER_REACH && n.pos.y >= top - 1.0f && n.pos.y <= bottom + 0.5f)
+					stops.push_back(std::make_pair(n.pos.y, ends[e]));
+			}
+		}
+		std::sort(stops.begin(), stops.end());
+		for (size_t i = 1; i < stops.size(); ++i) {
+			int a = stops[i-1].second, b = stops[i].second;
+			if (m_nodes[a].platform == m_nodes[b].platform) continue;
+			float cost = (m_nodes[b].pos - m_nodes[a].pos).Length() / speed_climb;
+			link(a, b, NavEdge::CLIMB, cost);
+			link(b, a, NavEdge::CLIMB, cost);
+		}
+	}
+	// Jumps and drops off the platform ends to nodes of other platforms
+	for (size_t p = 0; p < platforms.size(); ++p) {
+		int ends[] = { first[p], last[p] };
+		for (int e = 0; e < 2; ++e) {
+			const b2Vec2 from = m_nodes[ends[e]].pos;
+			int outward = (e == 0 ? -1 : 1);
+			for (size_t n = 0; n < m_nodes.size(); ++n) {
+				const NavNode& to = m_nodes[n];
+				if (to.platform == int(p)) continue;
+				float dx = (to.pos.x - from.x) * outward, dy = to.pos.y - from.y;
+				if (dx < 0.5f) continue;
+				if (dy < 0.5f) {
+					// Jump, the apex must be clear too
+					if (-dy > JUMP_UP || dx > JUMP_REACH + std::max(0.0f, dy)) continue;
+					b2Vec2 apex(from.x + outward * dx * 0.5f, std::min(from.y, to.pos.y) - JUMP_UP * 0.5f);
+					if (blocked(from, apex, p, to.platform) || blocked(apex, to.pos, p, to.platform)) continue;
+					link(ends[e], n, NavEdge::JUMP, dx / speed_move_airborne + JUMP_PENALTY);
+				} else {
+					// Drop, how far it drifts depends on the time falling
+					float fall = std::sqrt(2.0f * dy / GRAVITY);
+					if (dx > 1.0f + speed_move_airborne * fall) continue;
+					b2Vec2 edge(from.x + outward * 0.5f, from.y);
+					if (blocked(edge, to.pos, p, to.platform)) continue;
+					link(ends[e], n, NavEdge::DROP, dx / speed_move_ground + fall);
+				}
+			}
+		}
+	}
+}
+
+
+void NavGraph::link(int from, int to, NavEdge::Type type, float cost) {
+	m_nodes[from].edges.push_back(NavEdge(to, type, cost));
+}
+
+
+bool NavGraph::blocked(const b2Vec2& a, const b2Vec2& b, int skip1, int skip2) const {
+	for (size_t i = 0; i < m_platforms.size(); ++i) {
+		if (int(i) == skip1 || int(i) == skip2) continue;
+		const Box& box = m_platforms[i];
+		// Grown by half the actor, its center must pass clear of the edge
+		if (segmentHits(a, b, box.x1 - 0.25f, box.y1 - 0.25f, box.x2 + 0.25f, box.y2 + 0.25f)) return true;
+	}
+	return false;
+}
+
+
+int NavGraph::nearest(const b2Vec2& pos) const {
+	// Prefer the surface below over one overhead
+	int best = -1;
+	float best_d = 0;
+	for (size_t i = 0; i < m_nodes.size(); ++i) {
+		b2Vec2 d = m_nodes[i].pos - pos;
+		float dist = std::abs(d.x) + (d.y < -0.25f ? -d.y * 3.0f : d.y);
+		if (best < 0 || dist < best_d) { best = i; best_d = dist; }
+	}
+	return best;
+}
+
+
+const NavEdge* NavGraph::edge(int from, int to) const {
+	const std::vector<NavEdge>& edges = m_nodes[from].edges;
+	for (size_t i = 0; i < edges.size(); ++i)
+		if (edges[i].to == to) return &edges[i];
+	return NULL;
+}
+
+
+bool NavGraph::findPath(int start, int goal, std::vector<int>& path) const {
+	path.clear();
+	if (start < 0 || goal < 0 || start >= int(m_nodes.size()) || goal >= int(m_nodes.size())) return false;
+	std::pair<int, int> key(start, goal);
+	{
+		LOCKCACHE;
+		PathCache::const_iterator it = m_cache.find(key);
+		if (it != m_cache.end()) {
+			path = it->second;
+			return !path.empty();
+		}
+	}
+	// Searched outside the lock, another thread may do the same path meanwhile
+	search(start, goal, path);
+	LOCKCACHE;
+	if (m_cache.size() >= CACHE_SIZE) m_cache.clear();
+	m_cache[key] = path; // Unreachable ones too, they are the most expensive to search
+	return !path.empty();
+}
+
+
+void NavGraph::search(int start, int goal, std::vector<int>& path) const {
+	const float speed = speed_move_ground * 2.0f; // Faster than anything, keeps the estimate optimistic
+	std::vector<float> cost(m_nodes.size(), -1.0f);
+	std::vector<int> from(m_nodes.size(), -1);
+	std::priority_queue<Open> open;
+	cost[start] = 0;
+	open.push(Open(start, 0));
+	while (!open.empty()) {
+		int n = open.top().node;
+		open.pop();
+		if (n == goal) break;
+		const std::vector<NavEdge>& edges = m_nodes[n].edges;
+		for (size_t i = 0; i < edges.size(); ++i) {
+			int m = edges[i].to;
+			float c = cost[n] + edges[i].cost;
+			if (cost[m] >= 0 && cost[m] <= c) continue;
+			cost[m] = c;
+			from[m] = n;
+			open.push(Open(m, c + (m_nodes[goal].pos - m_nodes[m].pos).Length() / speed));
+		}
+	}
+	if (cost[goal] < 0) return;
+	for (int n = goal; n != -1; n = from[n]) path.push_back(n);
+	std::reverse(path.begin(), path.end());
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "config.hh"
+
+#include <vector>
+#include <map>
+#include <Box2D.h>
+#ifdef USE_THREADS
+#include <boost/thread/mutex.hpp>
+#endif
+
+#include "worldelements.hh"
+
+/// How one node can be reached from another
+struct NavEdge {
+	enum Type { WALK, JUMP, DROP, CLIMB };
+	NavEdge(int to, Type type, float cost): to(to), type(type), cost(cost) { }
+	int to;
+	Type type;
+	float cost; ///< Seconds, roughly
+};
+
+/// A spot an actor can stand on
+struct NavNode {
+	NavNode(b2Vec2 pos, int platform): pos(pos), platform(platform) { }
+	b2Vec2 pos; ///< Actor center when standing there
+	int platform;
+	std::vector<NavEdge> edges;
+};
+
+/// Where AI actors can go. Built once per level from the platforms, ladders
+/// and bridges; paths are searched with A* and cached, as the level is static.
+class NavGraph {
+  public:
+	NavGraph() { }
+
+	/// Replace the graph, water_level is the y below which nothing is safe
+	void build(const Platforms& platforms, const Ladders& ladders, const Bridges& bridges, float water_level);
+	void clear();
+
+	bool empty() const { return m_nodes.empty(); }
+	size_t size() const { return m_nodes.size(); }
+	const NavNode& node(int i) const { return m_nodes[i]; }
+
+	/// Node an actor at pos is standing on or is closest to, -1 if none
+	int nearest(const b2Vec2& pos) const;
+
+	/// Nodes from start to goal, both included. False if unreachable.
+	/// Safe to call from several threads.
+	bool findPath(int start, int goal, std::vector<int>& path) const;
+
+	/// The edge between two neighbouring nodes of a path
+	const NavEdge* edge(int from, int to) const;
+
+  private:
+	void link(int from, int to, NavEdge::Type type, float cost);
+	bool blocked(const b2Vec2& a, const b2Vec2& b, int skip1, int skip2) const;
+	void search(int start, int goal, std::vector<int>& path) const;
+
+	struct Box { float x1, y1, x2, y2; };
+
+	std::vector<NavNode> m_nodes;
+	std::vector<Box> m_platforms; ///< For testing jumps against obstacles
+	typedef std::map<std::pair<int, int>, std::vector<int> > PathCache;
+	mutable PathCache m_cache;
+	#ifdef USE_THREADS
+	mutable boost::mutex m_cacheMutex;
+	#endif
+};
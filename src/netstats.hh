@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstddef>
+
+#include "util.hh"
+
+/// Byte counts of one snapshot by entity type
+struct SnapshotSize {
+	SnapshotSize(): actors(0), crates(0), powerups(0), statics(0) { }
+	size_t total() const { return actors + crates + powerups + statics; }
+	size_t actors;
+	size_t crates;
+	size_t powerups;
+	size_t statics; ///< Platforms, ladders and bridges
+};
+
+/// Bytes per second, measured over windows of about a second
+struct RateCounter {
+	RateCounter(): total(0), window(0), rate(0), start(GetSecs()) { }
+	void add(size_t bytes) { total += bytes; window += bytes; roll(); }
+	void roll() {
+		double t = GetSecs();
+		if (t - start < 1.0) return;
+		rate = window / (t - start);
+		window = 0;
+		start = t;
+	}
+	double get() const { return rate; }
+	size_t total;
+	size_t window;
+	double rate;
+	double start;
+};
+
+/// Running statistics of one connection
+struct NetStats {
+	NetStats(): rtt(0), jitter(0), loss(0), snapshots(0), encode_ms(0), decode_ms(0), clock_offset(0), clock_drift(0) { }
+	double rtt;    ///< Round trip time, ms
+	double jitter; ///< Round trip time variance, ms
+	double loss;   ///< Packet loss, percent
+	RateCounter sent;
+	RateCounter received;
+	unsigned snapshots;    ///< Snapshots encoded or decoded
+	SnapshotSize snapshot; ///< Composition of the latest snapshot
+	double encode_ms;      ///< Time spent encoding the latest snapshot
+	double decode_ms;      ///< Time spent decoding the latest snapshot
+	double clock_offset;   ///< Server minus local clock, ms
+	double clock_drift;    ///< Server clock gain, parts per million
+};
@@ -1,97 +1,695 @@
 #include "config.hh"
 
 #ifdef USE_NETWORK
+#include <algorithm>
+#include <iomanip>
+#ifndef _WIN32
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 #include <Box2D.h>
 #include "network.hh"
 #include "world.hh"
 #include "player.hh"
+#include "profiler.hh"
 
 namespace {
 	static const char MYID = 80; // Identifies packet as being player id info.
+	static const char INPUT = 81; // Identifies packet as being client input frames.
+	static const char WORLD = 82; // Full world including static objects.
+	static const char STATE = 83; // Tick number and the dynamic world state.
+	static const char EVENTS = 84; // Gameplay events.
+	static const char LEVEL = 85; // Level version, seed and hash.
+	static const char WORLD_REQUEST = 86; // Client could not generate the level, asks for WORLD.
+	static const char PING = 87; // Client clock, for time synchronization.
+	static const char PONG = 88; // Echoed client clock, server clock and the newest tick with its time.
+
+	static const double PING_INTERVAL = 1.0; // Seconds
+	static const double PING_INTERVAL_FAST = 0.1; // Until there are enough samples for a first estimate
+	static const size_t PONG_SIZE = 25;
+	static const int SERVICE_TIMEOUT = 10; // Longest wait in ms, ENet needs regular servicing for resends and pings
+
+	uint32_t getU32(const enet_uint8* p) { return p[0] | (p[1] << 8) | (p[2] << 16) | (uint32_t(p[3]) << 24); }
+	void putU32(char* p, uint32_t v) { for (int i = 0; i < 4; ++i) p[i] = char(v >> (i * 8)); }
+
+	/// Clocks go on the wire as microseconds
+	uint64_t micros(double secs) { return uint64_t(secs * 1000000.0); }
+
+	/// Answer to a PING, sent unreliably so that a lost one doesn't delay the next
+	ENetPacket* encodePong(const enet_uint8* ping, uint32_t tick, double tick_time) {
+		uint64_t now = micros(GetPreciseSecs()), then = micros(tick_time);
+		char msg[PONG_SIZE] = { PONG };
+		std::copy(ping + 1, ping + 5, msg + 1);
+		putU32(msg + 5, uint32_t(now));
+		putU32(msg + 9, uint32_t(now >> 32));
+		putU32(msg + 13, tick);
+		putU32(msg + 17, uint32_t(then));
+		putU32(msg + 21, uint32_t(then >> 32));
+		return enet_packet_create(msg, sizeof(msg), 0);
+	}
+
+	/// Encodes the full world
+	struct WorldEncoder {
+		WorldEncoder(const World* world): world(world) { }
+		size_t operator()(char* buf, size_t size) const { return world->serialize(buf, size, false); }
+		const World* world;
+	};
+
+	/// Encodes what one client gets to see
+	struct StateEncoder {
+		StateEncoder(const WorldSnapshot& snapshot, const Interest& interest, SnapshotSize* sizes):
+		  snapshot(snapshot), interest(interest), sizes(sizes) { }
+		size_t operator()(char* buf, size_t size) const {
+			if (sizes) *sizes = SnapshotSize(); // Only count the last attempt
+			return snapshot.encode(buf, size, interest, sizes);
+		}
+		const WorldSnapshot& snapshot;
+		const Interest& interest;
+		SnapshotSize* sizes;
+	};
+
+	/// Encode world data after a header straight into a packet, growing it if it did not fit
+	template <typename Encoder>
+	ENetPacket* encodePacket(const char* header, size_t hsize, size_t& capacity, int flags, const Encoder& encode) {
+		ENetPacket* packet = enet_packet_create(NULL, std::max(capacity, hsize), flags);
+		std::copy(header, header + hsize, packet->data);
+		size_t size;
+		while ((size = hsize + encode(reinterpret_cast<char*>(packet->data) + hsize, packet->dataLength - hsize))
+		  > packet->dataLength) {
+			enet_packet_resize(packet, size);
+			capacity = size;
+		}
+		enet_packet_resize(packet, size);
+		return packet;
+	}
 }
 
 
-void Server::listen() {
+#ifndef _WIN32
+WakeSignal::WakeSignal() {
+	if (pipe(m_pipe) != 0) throw std::runtime_error("Cannot create a pipe for the network thread.");
+	for (int i = 0; i < 2; ++i) fcntl(m_pipe[i], F_SETFL, fcntl(m_pipe[i], F_GETFL) | O_NONBLOCK);
+}
+
+
+WakeSignal::~WakeSignal() {
+	close(m_pipe[0]);
+	close(m_pipe[1]);
+}
+
+
+void WakeSignal::notify() {
+	// A full pipe already has a wakeup pending
+	char c = 0;
+	if (write(m_pipe[1], &c, 1) < 0) { }
+}
+
+
+void WakeSignal::wait(ENetSocket socket, int timeout_ms) {
+	pollfd fds[] = { { socket, POLLIN, 0 }, { m_pipe[0], POLLIN, 0 } };
+	poll(fds, 2, timeout_ms);
+	char buf[64];
+	if (fds[1].revents & POLLIN) while (read(m_pipe[0], buf, sizeof(buf)) > 0) { }
+}
+#else
+// No pipes to select on, so wake up often instead
+WakeSignal::WakeSignal() { }
+WakeSignal::~WakeSignal() { }
+void WakeSignal::notify() { }
+void WakeSignal::wait(ENetSocket socket, int timeout_ms) {
+	enet_uint32 condition = ENET_SOCKET_WAIT_RECEIVE;
+	enet_socket_wait(socket, &condition, std::min(timeout_ms, 1));
+}
+#endif
+
+
+void NetworkObject::pump() {
+	m_signal.wait(m_host->socket, SERVICE_TIMEOUT);
+	PROFILE("net receive");
+	// Drain everything, one event per wakeup would let bursts queue up
 	ENetEvent e;
+	while (!m_quit && enet_host_service(m_host, &e, 0) > 0) handleEvent(e);
+}
+
+
+Server::Server(World* world, int port):
+  NetworkObject(world), m_workers(config_net_workers), m_levelHash(world->levelHash()), m_connections(0),
+  m_tick(0), m_tickTime(GetPreciseSecs())
+{
+	world->keepEvents(true); // For sendState
+	m_address.host = ENET_HOST_ANY;
+	m_address.port = port;
+	// Create host at address, peerCount, channelCount, unlimited up/down bandwith
+	m_host = enet_host_create(&m_address, config_net_maxclients, CHANNELS, 0, 0);
+	if (m_host == NULL)
+		throw std::runtime_error("An error occurred while trying to create an ENet host.");
+	// Start listener thread
+	m_thread = boost::thread(boost::bind(&Server::listen, boost::ref(*this)));
+}
+
+
+void Server::listen() {
+	// Runs on the network thread and never touches the World,
+	// everything for the simulation goes through post()
+	Profiler::nameThread("network");
 	while (!m_quit) {
-		enet_host_service(m_host, &e, 20);
-		switch (e.type) {
-		case ENET_EVENT_TYPE_CONNECT: {
-			std::cout << "Client connected from " << e.peer->address.host << ":" << e.peer->address.port << std::endl;
-			char newid = m_world->getActors().size() + 1;
-			// Spawn player
-			b2Vec2 pos = m_world->randomSpawn();
-			m_world->addActor(pos.x, pos.y, Actor::REMOTE, newid);
-			// Assign
-			e.peer->data = &m_world->getActors().back();
-			{ // Send starting info
-				std::string msg = "  ";
-				msg[0] = MYID;
-				msg[1] = newid;
-				ENetPacket* packet = enet_packet_create(msg.c_str(), msg.length(), ENET_PACKET_FLAG_RELIABLE);
-				enet_peer_send(e.peer, 0, packet); // Send through channel 0
-				enet_host_flush(m_host); // Don't dispatch events
+		flushQueues();
+		pump();
+	}
+}
+
+
+void Server::handleEvent(ENetEvent& e) {
+	switch (e.type) {
+	case ENET_EVENT_TYPE_CONNECT: {
+		std::cout << "Client connected from " << e.peer->address.host << ":" << e.peer->address.port
+		  << (e.data == ROLE_SPECTATOR ? " as spectator" : "") << std::endl;
+		NetMessage msg(NetMessage::JOIN, ++m_connections);
+		msg.role = (e.data == ROLE_SPECTATOR ? ROLE_SPECTATOR : ROLE_PLAYER);
+		{
+			boost::mutex::scoped_lock lock(m_peersMutex);
+			RemotePeer& rp = m_peers[e.peer];
+			rp = RemotePeer(msg.conn);
+			e.peer->data = &rp;
+		}
+		post(msg);
+		break;
+	} case ENET_EVENT_TYPE_RECEIVE: {
+		RemotePeer* rp = static_cast<RemotePeer*>(e.peer->data);
+		const enet_uint8* data = e.packet->data;
+		size_t len = e.packet->dataLength;
+		countReceived(len);
+		if (rp) {
+			boost::mutex::scoped_lock lock(m_peersMutex);
+			rp->stats.received.add(len);
+		}
+		if (rp && len == 1 && data[0] == WORLD_REQUEST) {
+			post(NetMessage(NetMessage::WORLD_REQUEST, rp->conn));
+		} else if (len == 5 && data[0] == PING) {
+			// Answered right away, any delay here would count as network latency
+			ENetPacket* pong;
+			{
+				boost::mutex::scoped_lock lock(m_clockMutex);
+				pong = encodePong(data, m_tick, m_tickTime);
 			}
-			{ // Send initial world data
-				std::string msg = m_world->serialize(false);
-				ENetPacket* packet = enet_packet_create(msg.c_str(), msg.length(), ENET_PACKET_FLAG_RELIABLE);
-				enet_peer_send(e.peer, 0, packet); // Send through channel 0
-				enet_host_flush(m_host); // Don't dispatch events
+			countSent(pong->dataLength);
+			enet_peer_send(e.peer, CHANNEL_STATE, pong);
+		} else if (rp && len >= 2 && data[0] == INPUT) {
+			// Frames are oldest first, skip the ones already posted
+			size_t frames = std::min<size_t>(data[1], (len - 2) / INPUT_FRAME_SIZE);
+			for (size_t i = 0; i < frames; ++i) {
+				const enet_uint8* fd = &data[2 + i * INPUT_FRAME_SIZE];
+				NetMessage msg(NetMessage::INPUT, rp->conn);
+				msg.input = InputFrame(fd[0] | (fd[1] << 8));
+				msg.input.buttons = fd[2];
+				msg.input.events = fd[3];
+				msg.input.view = fd[4] | (fd[5] << 8);
+				if (int16_t(msg.input.seq - rp->last_input) <= 0) continue;
+				rp->last_input = msg.input.seq;
+				post(msg);
 			}
-			break;
-		} case ENET_EVENT_TYPE_RECEIVE: {
-			Actor* pl = static_cast<Actor*>(e.peer->data);
-			if (pl && e.packet->dataLength == 1) {
-				switch (e.packet->data[0]) {
-					case OnlinePlayer::MOVE_LEFT: pl->move(-1); break;
-					case OnlinePlayer::MOVE_RIGHT: pl->move(1); break;
-					case OnlinePlayer::JUMP: pl->jump(); break;
-					case OnlinePlayer::DUCK: pl->duck(); break;
-					case OnlinePlayer::STOP_MOVING: pl->stop(); break;
-					case OnlinePlayer::STOP_JUMPING: pl->end_jumping(); break;
-					case OnlinePlayer::ACTION: pl->action(); break;
-				}
+		}
+		enet_packet_destroy (e.packet); // Clean-up
+		break;
+	} case ENET_EVENT_TYPE_DISCONNECT:
+		std::cout << "Client disconnected." << std::endl;
+		{
+			boost::mutex::scoped_lock lock(m_peersMutex);
+			RemotePeers::iterator it = m_peers.find(e.peer);
+			if (it != m_peers.end()) {
+				// Drop whatever was still waiting to be sent
+				RemotePeer& rp = it->second;
+				post(NetMessage(NetMessage::LEAVE, rp.conn));
+				for (size_t i = 0; i < rp.queue.size(); ++i) enet_packet_destroy(rp.queue[i]);
+				if (rp.state) enet_packet_destroy(rp.state);
+				m_peers.erase(it);
 			}
-			enet_packet_destroy (e.packet); // Clean-up
-			break;
-		} case ENET_EVENT_TYPE_DISCONNECT:
-			std::cout << "Client disconnected." << std::endl;
-			// TODO: Delete player
 			e.peer->data = NULL;
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+
+void Server::post(const NetMessage& msg) {
+	// Joins and leaves must not be lost, so wait for room rather than drop
+	while (!m_messages.push(msg)) boost::this_thread::yield();
+	boost::mutex::scoped_lock lock(m_wakeMutex);
+	m_wake.notify_one();
+}
+
+
+void Server::waitForMessages() {
+	boost::mutex::scoped_lock lock(m_wakeMutex);
+	while (m_messages.read_available() == 0) m_wake.wait(lock);
+}
+
+
+void Server::processMessages() {
+	PROFILE("net apply");
+	World::Scope scope(*m_world); // Input counts as happening at this tick boundary
+	NetMessage msg;
+	bool queued = false; // Replies for the network thread
+	while (m_messages.pop(msg)) {
+		queued = queued || msg.type == NetMessage::JOIN || msg.type == NetMessage::WORLD_REQUEST;
+		switch (msg.type) {
+		case NetMessage::JOIN: {
+			Actor* actor = NULL;
+			if (msg.role == ROLE_PLAYER) {
+				// Spawn player
+				actor = m_world->spawnActor(Actor::REMOTE);
+				m_players[msg.conn] = actor;
+				m_world->pushEvent(GameEvent(GameEvent::JOIN, actor->id));
+			}
+			boost::mutex::scoped_lock lock(m_peersMutex);
+			RemotePeer* rp = findPeer(msg.conn);
+			if (!rp) break; // Gone already, its LEAVE follows
+			rp->joined = true;
+			rp->actor = actor;
+			rp->interest = Interest(actor);
+			{ // Send starting info, id 0 for spectators
+				uint16_t id = actor ? actor->id : 0;
+				char info[] = { MYID, char(id & 0xFF), char(id >> 8) };
+				rp->queue.push_back(enet_packet_create(info, sizeof(info), ENET_PACKET_FLAG_RELIABLE));
+			}
+			// Describe the level, the client generates it or asks for the full world
+			rp->queue.push_back(encodeLevel());
+			break;
+		} case NetMessage::LEAVE: {
+			std::map<unsigned, Actor*>::iterator it = m_players.find(msg.conn);
+			if (it == m_players.end()) break;
+			m_world->pushEvent(GameEvent(GameEvent::LEAVE, it->second->id));
+			m_world->removeActor(it->second);
+			m_players.erase(it);
+			break;
+		} case NetMessage::INPUT: {
+			std::map<unsigned, Actor*>::iterator it = m_players.find(msg.conn);
+			if (it == m_players.end()) break;
+			// Full tick from its low bits, shots get resolved against that moment.
+			// Clients can't pick one beyond the rewind window or the current tick.
+			uint32_t now = m_world->getTick();
+			uint32_t age = std::min<uint32_t>(std::min<uint32_t>(uint16_t(now - msg.input.view), World::rewindTicks()), now);
+			m_world->input(it->second, msg.input, msg.input.view ? now - age : 0);
 			break;
-		default:
+		} case NetMessage::WORLD_REQUEST: {
+			std::cout << "Client could not generate the level, sending it." << std::endl;
+			boost::mutex::scoped_lock lock(m_peersMutex);
+			if (RemotePeer* rp = findPeer(msg.conn)) rp->queue.push_back(encodeWorld());
 			break;
 		}
+		}
+	}
+	if (queued) m_signal.notify();
+}
+
+
+RemotePeer* Server::findPeer(unsigned conn) {
+	for (RemotePeers::iterator it = m_peers.begin(); it != m_peers.end(); ++it)
+		if (it->second.conn == conn) return &it->second;
+	return NULL;
+}
+
+
+ENetPacket* Server::encodeWorld() {
+	size_t capacity = 0;
+	return encodePacket(&WORLD, 1, capacity, ENET_PACKET_FLAG_RELIABLE, WorldEncoder(m_world));
+}
+
+
+ENetPacket* Server::encodeLevel() {
+	uint32_t seed = m_world->getLevelSeed();
+	char msg[] = { LEVEL, char(LEVEL_VERSION & 0xFF), char(LEVEL_VERSION >> 8),
+	  char(seed), char(seed >> 8), char(seed >> 16), char(seed >> 24),
+	  char(m_levelHash), char(m_levelHash >> 8), char(m_levelHash >> 16), char(m_levelHash >> 24) };
+	return enet_packet_create(msg, sizeof(msg), ENET_PACKET_FLAG_RELIABLE);
+}
+
+
+void Server::encodeState(size_t job) {
+	// Runs on a worker, touches only its own peer and the shared snapshot
+	PROFILE("net encode");
+	RemotePeer& rp = *m_jobs[job];
+	double start = GetPreciseSecs();
+	rp.interest.prioritize(m_snapshot);
+	uint32_t tick = m_snapshot.tick;
+	char header[] = { STATE, char(tick), char(tick >> 8), char(tick >> 16), char(tick >> 24) };
+	ENetPacket* packet = encodePacket(header, sizeof(header), rp.capacity, 0,
+	  StateEncoder(m_snapshot, rp.interest, &rp.stats.snapshot));
+	rp.stats.encode_ms = (GetPreciseSecs() - start) * 1000.0;
+	++rp.stats.snapshots;
+	// A state the network thread didn't get to yet is stale already
+	if (rp.state) enet_packet_destroy(rp.state);
+	rp.state = packet;
+}
+
+
+void Server::sendState() {
+	PROFILE("net send");
+	// Gameplay events, one packet per tick unless there are more than its count can say
+	GameEvents events = m_world->takeEvents();
+	std::vector<std::string> msgs;
+	for (size_t first = 0; first < events.size(); first += 255) {
+		size_t count = std::min<size_t>(events.size() - first, 255);
+		std::string msg(2 + count * EVENT_SIZE, '\0');
+		msg[0] = EVENTS;
+		msg[1] = char(count);
+		for (size_t i = 0; i < count; ++i)
+			encodeEvent(events[first + i], &msg[2 + i * EVENT_SIZE]);
+		msgs.push_back(msg);
+	}
+	// Serialize every entity once, the clients only pick from it
+	m_world->capture(m_snapshot);
+	{
+		boost::mutex::scoped_lock lock(m_clockMutex);
+		m_tick = m_snapshot.tick;
+		m_tickTime = GetPreciseSecs();
+	}
+	boost::mutex::scoped_lock lock(m_peersMutex);
+	m_jobs.clear();
+	for (RemotePeers::iterator it = m_peers.begin(); it != m_peers.end(); ++it) {
+		RemotePeer& rp = it->second;
+		if (!rp.joined) continue;
+		for (size_t i = 0; i < msgs.size(); ++i)
+			rp.queue.push_back(enet_packet_create(msgs[i].data(), msgs[i].length(), ENET_PACKET_FLAG_RELIABLE));
+		m_jobs.push_back(&rp);
+	}
+	m_workers.run(m_jobs.size(), boost::bind(&Server::encodeState, this, _1));
+	m_signal.notify();
+}
+
+
+void Server::flushQueues() {
+	// Only the network thread hands packets to ENet
+	PROFILE("net flush");
+	boost::mutex::scoped_lock lock(m_peersMutex);
+	bool sent = false;
+	for (RemotePeers::iterator it = m_peers.begin(); it != m_peers.end(); ++it) {
+		RemotePeer& rp = it->second;
+		readPeer(rp.stats, it->first);
+		for (size_t i = 0; i < rp.queue.size(); ++i) {
+			rp.stats.sent.add(rp.queue[i]->dataLength);
+			countSent(rp.queue[i]->dataLength);
+			enet_peer_send(it->first, CHANNEL_EVENTS, rp.queue[i]);
+		}
+		if (rp.state) {
+			rp.stats.sent.add(rp.state->dataLength);
+			countSent(rp.state->dataLength);
+			enet_peer_send(it->first, CHANNEL_STATE, rp.state);
+		}
+		sent = sent || rp.state || !rp.queue.empty();
+		rp.queue.clear();
+		rp.state = NULL;
+	}
+	if (sent) enet_host_flush(m_host); // Don't dispatch events
+}
+
+
+namespace {
+	std::ostream& operator<<(std::ostream& os, const NetStats& s) {
+		os << std::fixed << std::setprecision(1)
+		  << "rtt " << s.rtt << " ms, jitter " << s.jitter << " ms, loss " << s.loss << "%, "
+		  << "out " << s.sent.get() / 1024.0 << " kB/s, in " << s.received.get() / 1024.0 << " kB/s";
+		if (s.snapshots)
+			os << ", snapshot " << s.snapshot.total() << " B (actors " << s.snapshot.actors
+			  << ", crates " << s.snapshot.crates << ", powerups " << s.snapshot.powerups
+			  << ", static " << s.snapshot.statics << ") in " << std::setprecision(3) << s.encode_ms << " ms";
+		return os;
+	}
+}
+
+
+void Server::printStats(std::ostream& os) {
+	NetStats total = getStats();
+	boost::mutex::scoped_lock lock(m_peersMutex);
+	os << "Network: " << m_peers.size() << " clients, out " << std::fixed << std::setprecision(1)
+	  << total.sent.get() / 1024.0 << " kB/s, in " << total.received.get() / 1024.0 << " kB/s" << std::endl;
+	for (RemotePeers::iterator it = m_peers.begin(); it != m_peers.end(); ++it) {
+		RemotePeer& rp = it->second;
+		rp.stats.sent.roll();
+		rp.stats.received.roll();
+		if (rp.actor) os << "  " << rp.actor->getName() << ": ";
+		else os << "  spectator: ";
+		os << rp.stats << std::endl;
 	}
 }
 
 
 void Client::listen() {
-	ENetEvent e;
+	Profiler::nameThread("network");
 	while (!m_quit) {
-		enet_host_service(m_host, &e, 20);
-		switch (e.type) {
-		case ENET_EVENT_TYPE_RECEIVE: {
-			if (e.packet->data[0] == MYID) {
-				// Get id
-				m_id = e.packet->data[1];
-			} else {
-				// Update state
-				m_world->update(std::string((char*)e.packet->data, e.packet->dataLength), this);
+		bool sent = flushInput();
+		if (GetPreciseSecs() >= m_nextPing) { sendPing(); sent = true; }
+		// Out now, pump() only sends once something arrives or it times out
+		if (sent) enet_host_flush(m_host);
+		pump();
+		boost::mutex::scoped_lock lock(m_statsMutex);
+		readPeer(m_stats, m_peer);
+	}
+}
+
+
+void Client::handleEvent(ENetEvent& e) {
+	switch (e.type) {
+	case ENET_EVENT_TYPE_RECEIVE: {
+		const enet_uint8* data = e.packet->data;
+		size_t len = e.packet->dataLength;
+		countReceived(len);
+		if (data[0] == MYID && len >= 3) {
+			// Get id
+			m_id = data[1] | (data[2] << 8);
+		} else if (data[0] == LEVEL && len >= 11) {
+			uint16_t version = data[1] | (data[2] << 8);
+			uint32_t seed = data[3] | (data[4] << 8) | (data[5] << 16) | (uint32_t(data[6]) << 24);
+			uint32_t hash = data[7] | (data[8] << 8) | (data[9] << 16) | (uint32_t(data[10]) << 24);
+			if (version == LEVEL_VERSION) {
+				m_world->generateLevel(seed);
+				m_levelReady = m_world->levelHash() == hash;
+				if (!m_levelReady) m_world->clearLevel();
 			}
-			// Clean-up
-			enet_packet_destroy(e.packet);
-			break;
-		} case ENET_EVENT_TYPE_DISCONNECT:
-			std::cout << "Server disconnected." << std::endl;
-			// TODO: Handle properly
-			e.peer->data = NULL;
-			throw std::runtime_error("Server disconnected.");
-			break;
-		default:
-			break;
+			if (!m_levelReady) {
+				std::cout << "Could not generate the level, requesting it from the server." << std::endl;
+				send(std::string(1, WORLD_REQUEST), ENET_PACKET_FLAG_RELIABLE);
+			}
+		} else if (data[0] == WORLD) {
+			// Full world, reading straight from the packet
+			m_world->update(reinterpret_cast<const char*>(data + 1), len - 1, this);
+			m_levelReady = true;
+		} else if (data[0] == STATE && len >= 5 && m_levelReady) {
+			// Actors and crates must not exist before the level was built
+			// Drop states older than the one already applied
+			uint32_t tick = data[1] | (data[2] << 8) | (data[3] << 16) | (uint32_t(data[4]) << 24);
+			uint32_t last = m_lastTick.load(std::memory_order_relaxed);
+			if (int32_t(tick - last) > 0 || last == 0) {
+				SnapshotSize sizes;
+				double start = GetPreciseSecs();
+				m_world->update(reinterpret_cast<const char*>(data + 5), len - 5, this, &sizes);
+				// Only now is it what the player sees
+				m_lastTick.store(tick, std::memory_order_release);
+				boost::mutex::scoped_lock lock(m_statsMutex);
+				m_stats.decode_ms = (GetPreciseSecs() - start) * 1000.0;
+				m_stats.snapshot = sizes;
+				++m_stats.snapshots;
+			}
+		} else if (data[0] == EVENTS && len >= 2) {
+			for (size_t i = 0; i < data[1] && 2 + (i + 1) * EVENT_SIZE <= len; ++i)
+				m_world->applyEvent(decodeEvent(&data[2 + i * EVENT_SIZE]));
+		} else if (data[0] == PONG && len >= PONG_SIZE) {
+			double now = GetPreciseSecs();
+			double sent = now - uint32_t(uint32_t(micros(now)) - getU32(data + 1)) / 1000000.0;
+			double server = (getU32(data + 5) | (uint64_t(getU32(data + 9)) << 32)) / 1000000.0;
+			double tick_time = (getU32(data + 17) | (uint64_t(getU32(data + 21)) << 32)) / 1000000.0;
+			boost::mutex::scoped_lock lock(m_clockMutex);
+			m_clock.addSample(sent, now, server);
+			m_clock.setTick(getU32(data + 13), tick_time);
+			boost::mutex::scoped_lock statslock(m_statsMutex);
+			m_stats.clock_offset = m_clock.offset * 1000.0;
+			m_stats.clock_drift = m_clock.drift * 1000000.0;
 		}
+		// Clean-up
+		enet_packet_destroy(e.packet);
+		break;
+	} case ENET_EVENT_TYPE_DISCONNECT:
+		std::cout << "Server disconnected." << std::endl;
+		// TODO: Handle properly
+		e.peer->data = NULL;
+		throw std::runtime_error("Server disconnected.");
+		break;
+	default:
+		break;
 	}
 }
 
+
+void Client::sendPing() {
+	char msg[5] = { PING };
+	putU32(msg + 1, uint32_t(micros(GetPreciseSecs())));
+	send(enet_packet_create(msg, sizeof(msg), 0), CHANNEL_STATE);
+	++m_pings;
+	m_nextPing = GetPreciseSecs() + (m_pings < CLOCK_SAMPLES / 4 ? PING_INTERVAL_FAST : PING_INTERVAL);
+}
+
+
+void Client::sendInput() {
+	PROFILE("net input");
+	boost::mutex::scoped_lock lock(m_inputMutex);
+	InputFrame f = m_input;
+	m_input = InputFrame();
+	// Once idle frames have been repeated enough, there is nothing new to say
+	if (f.empty()) {
+		if (m_idleFrames >= INPUT_REDUNDANCY) return;
+		++m_idleFrames;
+	} else m_idleFrames = 0;
+	f.seq = ++m_inputSeq;
+	f.view = m_lastTick.load(std::memory_order_acquire); // States are shown as they arrive, without an interpolation delay
+	if (m_historySize < INPUT_REDUNDANCY) ++m_historySize;
+	std::copy(m_history + 1, m_history + INPUT_REDUNDANCY, m_history);
+	m_history[INPUT_REDUNDANCY - 1] = f;
+	// Packet: INPUT, frame count, frames oldest first (seq lo, seq hi, buttons, events, view lo, view hi)
+	std::string msg(2 + m_historySize * INPUT_FRAME_SIZE, '\0');
+	msg[0] = INPUT;
+	msg[1] = m_historySize;
+	for (int i = 0; i < m_historySize; ++i) {
+		const InputFrame& h = m_history[INPUT_REDUNDANCY - m_historySize + i];
+		char* fd = &msg[2 + i * INPUT_FRAME_SIZE];
+		fd[0] = h.seq & 0xFF;
+		fd[1] = h.seq >> 8;
+		fd[2] = h.buttons;
+		fd[3] = h.events;
+		fd[4] = h.view & 0xFF;
+		fd[5] = h.view >> 8;
+	}
+	// Handed to the network thread, which sends it right away
+	m_outgoing.push_back(enet_packet_create(msg.c_str(), msg.length(), 0));
+	m_signal.notify();
+}
+
+
+bool Client::flushInput() {
+	std::vector<ENetPacket*> packets;
+	{
+		boost::mutex::scoped_lock lock(m_inputMutex);
+		packets.swap(m_outgoing);
+	}
+	for (size_t i = 0; i < packets.size(); ++i) send(packets[i], CHANNEL_STATE);
+	return !packets.empty();
+}
+
+
+Relay::Relay(std::string host, int port, int listen_port, double delay):
+  m_up(NULL), m_server(NULL), m_down(NULL), m_delay(delay), m_worldRequested(false), m_tick(0), m_tickTime(GetPreciseSecs())
+{
+	m_up = enet_host_create(NULL, 1, CHANNELS, 0, 0);
+	ENetAddress address;
+	address.host = ENET_HOST_ANY;
+	address.port = listen_port;
+	m_down = enet_host_create(&address, config_relay_maxclients, CHANNELS, 0, 0);
+	if (m_up == NULL || m_down == NULL)
+		throw std::runtime_error("An error occurred while trying to create an ENet host.");
+	enet_address_set_host(&address, host.c_str());
+	address.port = port;
+	m_server = enet_host_connect(m_up, &address, CHANNELS, ROLE_SPECTATOR);
+	ENetEvent event;
+	if (m_server == NULL || enet_host_service(m_up, &event, 5000) <= 0 || event.type != ENET_EVENT_TYPE_CONNECT)
+		throw std::runtime_error(std::string("Connection to ") + host + " failed!");
+}
+
+
+Relay::~Relay() {
+	for (size_t i = 0; i < m_delayed.size(); ++i) enet_packet_destroy(m_delayed[i].packet);
+	if (m_down) enet_host_destroy(m_down);
+	if (m_up) enet_host_destroy(m_up);
+}
+
+
+void Relay::run() {
+	ENetEvent e;
+	while (true) {
+		// Upstream drives the pace, downstream only sends requests
+		if (enet_host_service(m_up, &e, 5) > 0) {
+			do upstream(e); while (enet_host_service(m_up, &e, 0) > 0);
+		}
+		while (enet_host_service(m_down, &e, 0) > 0) downstream(e);
+		// One packet for all downstream peers
+		double now = GetSecs();
+		bool sent = false;
+		for (; !m_delayed.empty() && m_delayed.front().due <= now; m_delayed.pop_front()) {
+			const ENetPacket* p = m_delayed.front().packet;
+			if (p->dataLength >= 5 && p->data[0] == STATE) {
+				m_tick = getU32(p->data + 1);
+				m_tickTime = GetPreciseSecs();
+			}
+			enet_host_broadcast(m_down, m_delayed.front().channel, m_delayed.front().packet);
+			sent = true;
+		}
+		if (sent) enet_host_flush(m_down);
+	}
+}
+
+
+void Relay::upstream(ENetEvent& e) {
+	if (e.type == ENET_EVENT_TYPE_DISCONNECT) throw std::runtime_error("Server disconnected.");
+	if (e.type != ENET_EVENT_TYPE_RECEIVE) return;
+	const char* data = reinterpret_cast<const char*>(e.packet->data);
+	size_t len = e.packet->dataLength;
+	if (len == 0 || data[0] == MYID) {
+		enet_packet_destroy(e.packet); // Everyone downstream gets id 0 from the relay
+	} else if (data[0] == LEVEL) {
+		// Static, no point in delaying it
+		m_level.assign(data, len);
+		enet_host_broadcast(m_down, CHANNEL_EVENTS, e.packet);
+	} else if (data[0] == WORLD) {
+		m_world.assign(data, len);
+		for (size_t i = 0; i < m_waitingWorld.size(); ++i) sendCopy(m_waitingWorld[i], m_world);
+		m_waitingWorld.clear();
+		enet_packet_destroy(e.packet);
+	} else {
+		// States and events, the received packet is passed on as is
+		Delayed d = { GetSecs() + m_delay, e.channelID, e.packet };
+		m_delayed.push_back(d);
+	}
+}
+
+
+void Relay::downstream(ENetEvent& e) {
+	switch (e.type) {
+	case ENET_EVENT_TYPE_CONNECT: {
+		std::cout << "Spectator connected from " << e.peer->address.host << ":" << e.peer->address.port
+		  << ", " << m_down->connectedPeers << " watching" << std::endl;
+		const char info[] = { MYID, 0, 0 };
+		sendCopy(e.peer, std::string(info, sizeof(info)));
+		if (!m_level.empty()) sendCopy(e.peer, m_level);
+		break;
+	} case ENET_EVENT_TYPE_RECEIVE:
+		// Spectators have no input, they only sync their clock or ask for the full world
+		if (e.packet->dataLength == 5 && e.packet->data[0] == PING) {
+			// The relay's own clock, its delayed ticks are what the spectators see
+			enet_peer_send(e.peer, CHANNEL_STATE, encodePong(e.packet->data, m_tick, m_tickTime));
+		} else if (e.packet->dataLength == 1 && e.packet->data[0] == WORLD_REQUEST) {
+			if (!m_world.empty()) sendCopy(e.peer, m_world);
+			else {
+				m_waitingWorld.push_back(e.peer);
+				if (!m_worldRequested) enet_peer_send(m_server, CHANNEL_EVENTS,
+				  enet_packet_create(&WORLD_REQUEST, 1, ENET_PACKET_FLAG_RELIABLE));
+				m_worldRequested = true;
+			}
+		}
+		enet_packet_destroy(e.packet);
+		break;
+	case ENET_EVENT_TYPE_DISCONNECT:
+		m_waitingWorld.erase(std::remove(m_waitingWorld.begin(), m_waitingWorld.end(), e.peer), m_waitingWorld.end());
+		std::cout << "Spectator disconnected." << std::endl;
+		break;
+	default:
+		break;
+	}
+}
+
+
+void Relay::sendCopy(ENetPeer* peer, const std::string& data) {
+	enet_peer_send(peer, CHANNEL_EVENTS, enet_packet_create(data.data(), data.size(), ENET_PACKET_FLAG_RELIABLE));
+}
+
 #endif // USE_NETWORK
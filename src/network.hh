@@ -6,13 +6,27 @@
 #include <cstdio>
 #include <iostream>
 #include <string>
+#include <map>
+#include <deque>
+#include <vector>
 #include <stdexcept>
+#include <atomic>
+#include <stdint.h>
 #include <boost/shared_ptr.hpp>
 #include <boost/bind.hpp>
 #include <boost/thread.hpp>
 #include <boost/noncopyable.hpp>
+#include <boost/lockfree/spsc_queue.hpp>
 #include <enet/enet.h>
 
+#include "input.hh"
+#include "interest.hh"
+#include "snapshot.hh"
+#include "netstats.hh"
+#include "timesync.hh"
+#include "settings.hh"
+#include "workers.hh"
+
 
 /// RAII Wrapper
 struct ENetContainer {
@@ -21,11 +35,71 @@ struct ENetContainer {
 };
 
 
+/// How many previous frames are repeated in each input packet
+#define INPUT_REDUNDANCY 4
+/// Bytes per frame in an input packet
+#define INPUT_FRAME_SIZE 6
+
+/// ENet channels. Events are reliable, state is unreliable and sequenced
+/// so that a stale snapshot never holds back an event or a newer snapshot.
+enum Channel { CHANNEL_EVENTS, CHANNEL_STATE, CHANNELS };
+
+/// Sent as connect data to tell the server what the client wants to be
+enum ClientRole { ROLE_PLAYER, ROLE_SPECTATOR };
+
+
 class World;
+class Actor;
+
+/// Network event handed from the network thread to the simulation
+struct NetMessage {
+	enum Type { JOIN, LEAVE, INPUT, WORLD_REQUEST };
+	NetMessage(Type type = JOIN, unsigned conn = 0): type(type), conn(conn), role(ROLE_PLAYER) { }
+	Type type;
+	unsigned conn; ///< Connection number, ENet reuses its peers
+	ClientRole role; ///< JOIN only
+	InputFrame input; ///< INPUT only
+};
+
+/// Capacity of the network to simulation queue
+#define NET_QUEUE_SIZE 4096
+
+/// Server-side state of a connected client
+struct RemotePeer {
+	RemotePeer(unsigned conn = 0): conn(conn), joined(false), actor(NULL), last_input(0), state(NULL), capacity(0) { }
+	unsigned conn;
+	bool joined; ///< The simulation has processed the JOIN
+	Actor* actor; ///< NULL for spectators and until the simulation has spawned it
+	uint16_t last_input; ///< Sequence number of the newest received input frame, network thread only
+	Interest interest; ///< What this client gets to see
+	std::deque<ENetPacket*> queue; ///< Outgoing reliable event channel packets
+	ENetPacket* state; ///< Newest unsent state, replaced when a newer one arrives
+	size_t capacity; ///< Size of the largest state packet so far
+	NetStats stats;
+};
+
+typedef std::map<ENetPeer*, RemotePeer> RemotePeers;
+
+
+/// Lets other threads interrupt the network thread's wait for packets
+class WakeSignal: public boost::noncopyable {
+  public:
+	WakeSignal();
+	~WakeSignal();
+	/// Wake the waiting thread, or make its next wait return at once
+	void notify();
+	/// Until the socket is readable, notify() was called or the timeout passed
+	void wait(ENetSocket socket, int timeout_ms);
+  private:
+	#ifndef _WIN32
+	int m_pipe[2]; ///< Self-pipe, readable while a wakeup is pending
+	#endif
+};
+
 
 class NetworkObject: public boost::noncopyable {
   public:
-	NetworkObject(World* world): m_quit(false), m_id(), m_world(world), m_host(NULL), m_peer(NULL) { }
+	NetworkObject(World* world): m_quit(false), m_world(world), m_host(NULL), m_peer(NULL) { }
 
 	~NetworkObject() {
 		terminate();
@@ -35,62 +109,130 @@ class NetworkObject: public boost::noncopyable {
 
 	virtual void listen() { }
 
-	/// Send a string
-	void send(std::string msg, int flag = 0) {
-		ENetPacket* packet = enet_packet_create (msg.c_str(), msg.length(), flag);
-		if (m_peer) enet_peer_send(m_peer, 0, packet); // Send to peer through channel 0
-		else enet_host_broadcast(m_host, 0, packet); // Send through channel 0 to all peers
+	/// Called by other threads after queueing something for the network thread
+	void wake() { m_signal.notify(); }
+
+	/// Send a packet, ownership is passed to ENet
+	void send(ENetPacket* packet, Channel channel = CHANNEL_EVENTS) {
+		countSent(packet->dataLength);
+		if (m_peer) enet_peer_send(m_peer, channel, packet); // Send to peer
+		else enet_host_broadcast(m_host, channel, packet); // Send to all peers
 	}
 
-	/// Send a char
-	void send(char ch, int flag = 0) {
-		send(std::string(1, ch), flag);
+	/// Send a string
+	void send(std::string msg, int flag = 0, Channel channel = CHANNEL_EVENTS) {
+		send(enet_packet_create(msg.c_str(), msg.length(), flag), channel);
 	}
 
-	void terminate() { m_quit = true; m_thread.join(); }
+	/// Stop the network thread. Derived classes call this in their destructor,
+	/// the thread uses their members until it is joined.
+	void terminate() { m_quit = true; m_signal.notify(); if (m_thread.joinable()) m_thread.join(); }
+
+	/// Server clock at a local GetPreciseSecs() time
+	double remoteTime(double local) const { boost::mutex::scoped_lock lock(m_clockMutex); return m_clock.toRemote(local); }
+	/// Local GetPreciseSecs() time at which the server simulated a tick
+	double tickTime(uint32_t tick) const { boost::mutex::scoped_lock lock(m_clockMutex); return m_clock.tickTime(tick); }
+	bool clockSynced() const { boost::mutex::scoped_lock lock(m_clockMutex); return m_clock.synced(); }
+
+	/// Copy of the statistics of the whole host
+	NetStats getStats() const {
+		boost::mutex::scoped_lock lock(m_statsMutex);
+		NetStats stats = m_stats;
+		stats.sent.roll();
+		stats.received.roll();
+		return stats;
+	}
 
   protected:
+	/// Sleep until there is traffic or a wakeup, then handle every pending event.
+	/// ENet sends whatever is queued when the last one has been handled.
+	void pump();
+	virtual void handleEvent(ENetEvent&) { }
+
+	void countSent(size_t bytes) { boost::mutex::scoped_lock lock(m_statsMutex); m_stats.sent.add(bytes); }
+	void countReceived(size_t bytes) { boost::mutex::scoped_lock lock(m_statsMutex); m_stats.received.add(bytes); }
+
+	/// Copy ENet's round trip and loss measurements
+	static void readPeer(NetStats& stats, const ENetPeer* peer) {
+		stats.rtt = peer->roundTripTime;
+		stats.jitter = peer->roundTripTimeVariance;
+		stats.loss = 100.0 * peer->packetLoss / ENET_PEER_PACKET_LOSS_SCALE;
+	}
+
+	mutable boost::mutex m_statsMutex;
+	NetStats m_stats;
+	mutable boost::mutex m_clockMutex;
+	ClockSync m_clock; ///< Clients only, the server answers pings
 	bool m_quit;
-	char m_id;
 	World* m_world;
 	ENetAddress m_address;
 	ENetHost* m_host;
 	ENetPeer* m_peer;
+	WakeSignal m_signal;
 	boost::thread m_thread;
 };
 
 class Server: public NetworkObject {
   public:
-	Server(World* world, int port): NetworkObject(world) {
-		m_address.host = ENET_HOST_ANY;
-		m_address.port = port;
-		// Create host at address, peerCount, channelCount, unlimited up/down bandwith
-		m_host = enet_host_create(&m_address, 16, 2, 0, 0);
-		if (m_host == NULL)
-			throw std::runtime_error("An error occurred while trying to create an ENet host.");
-		// Start listener thread
-		m_thread = boost::thread(boost::bind(&Server::listen, boost::ref(*this)));
-	}
+	Server(World* world, int port);
+	~Server() { terminate(); }
 
 	void listen();
+
+	/// Wait until the network thread has posted something
+	void waitForMessages();
+
+	/// Apply joins, leaves and inputs received since the last call.
+	/// Called by the simulation thread, which owns all World mutation.
+	void processMessages();
+
+	/// Queue the gameplay events and the world state relevant to each client
+	void sendState();
+
+	/// Print the totals and a line per client
+	void printStats(std::ostream& os);
+
+  private:
+	void handleEvent(ENetEvent& e);
+	void post(const NetMessage& msg);
+	RemotePeer* findPeer(unsigned conn);
+	ENetPacket* encodeWorld();
+	ENetPacket* encodeLevel();
+	void encodeState(size_t job);
+	void flushQueues();
+
+	boost::mutex m_peersMutex;
+	RemotePeers m_peers;
+	WorldSnapshot m_snapshot; ///< Taken once per tick, shared by the state encoders
+	WorkerPool m_workers;
+	std::vector<RemotePeer*> m_jobs; ///< Peers getting a state this tick
+	uint32_t m_levelHash; ///< For clients to check the level they generated
+	unsigned m_connections; ///< Connections so far, network thread only
+	boost::lockfree::spsc_queue<NetMessage, boost::lockfree::capacity<NET_QUEUE_SIZE> > m_messages;
+	boost::mutex m_wakeMutex;
+	boost::condition_variable m_wake;
+	std::map<unsigned, Actor*> m_players; ///< Actors by connection, simulation thread only
+	uint32_t m_tick;   ///< Newest tick sent, for answering pings, under m_clockMutex
+	double m_tickTime; ///< When it was sent
 };
 
 
 class Client: public NetworkObject {
   public:
 	/// Construct new
-	Client(World* world): NetworkObject(world), m_id(0) { }
+	Client(World* world): NetworkObject(world), m_id(0), m_levelReady(false), m_lastTick(0), m_input(), m_inputSeq(0), m_historySize(0), m_idleFrames(0), m_nextPing(0), m_pings(0) { }
+	~Client() { terminate(); }
 
-	void connect(std::string host, int port) {
+	void connect(std::string host, int port, ClientRole role = ROLE_PLAYER) {
 		// Create host at address, peerCount, channelCount, unlimited up/down bandwith
-		m_host = enet_host_create(NULL, 2, 2, 0, 0);
+		m_host = enet_host_create(NULL, 2, CHANNELS, 0, 0);
 		if (m_host == NULL)
 			throw std::runtime_error("An error occurred while trying to create an ENet host.");
 
 		enet_address_set_host(&m_address, host.c_str());
 		m_address.port = port;
-		// Initiate the connection, allocating the two channels 0 and 1, with 0 data.
-		m_peer = enet_host_connect(m_host, &m_address, 2, 0);
+		// Initiate the connection, allocating the channels, with the role as data.
+		m_peer = enet_host_connect(m_host, &m_address, CHANNELS, role);
 		if (m_peer == NULL)
 			throw std::runtime_error("No available peers for initiating an ENet connection.");
 		// Wait up to 5 seconds for the connection attempt to succeed.
@@ -107,17 +249,82 @@ class Client: public NetworkObject {
 
 	void listen();
 
-	char getID() const { return m_id; }
+	uint16_t getID() const { return m_id; }
+
+	/// Add held buttons and events to the input frame being built
+	void input(uint8_t buttons, uint8_t events = 0) {
+		boost::mutex::scoped_lock lock(m_inputMutex);
+		m_input.buttons |= buttons;
+		m_input.events |= events;
+	}
+
+	/// Close the current input frame and send it along with the previous ones
+	void sendInput();
 
   private:
-	char m_id;
+	void handleEvent(ENetEvent& e);
+	void sendPing();
+	/// Send the input queued on other threads, false if there was none
+	bool flushInput();
+
+	uint16_t m_id;
+	bool m_levelReady; ///< Static level is in place, states can be applied
+	std::atomic<uint32_t> m_lastTick; ///< Tick of the newest applied state, read by sendInput
+	boost::mutex m_inputMutex;
+	InputFrame m_input;
+	uint16_t m_inputSeq;
+	InputFrame m_history[INPUT_REDUNDANCY]; ///< Newest frame last
+	std::vector<ENetPacket*> m_outgoing; ///< Input packets for the network thread to send
+	int m_historySize;
+	int m_idleFrames;
+	double m_nextPing;
+	unsigned m_pings; ///< Sent so far, the first ones go out faster
+};
+
+
+/// Connects to a server as a single spectator and passes what it receives
+/// on to any number of downstream spectators, optionally delayed. The game
+/// server's cost stays the same however many people watch.
+class Relay: public boost::noncopyable {
+  public:
+	Relay(std::string host, int port, int listen_port, double delay);
+	~Relay();
+
+	/// Relay until the upstream server disconnects
+	void run();
+
+  private:
+	/// Packet waiting for the broadcast delay
+	struct Delayed {
+		double due;
+		enet_uint8 channel;
+		ENetPacket* packet;
+	};
+
+	void upstream(ENetEvent& e);
+	void downstream(ENetEvent& e);
+	void sendCopy(ENetPeer* peer, const std::string& data);
+
+	ENetHost* m_up;
+	ENetPeer* m_server;
+	ENetHost* m_down;
+	double m_delay; ///< Seconds
+	std::deque<Delayed> m_delayed;
+	std::string m_level; ///< For spectators joining later
+	std::string m_world; ///< Full world, fetched when a spectator can't generate the level
+	bool m_worldRequested;
+	std::vector<ENetPeer*> m_waitingWorld;
+	uint32_t m_tick;   ///< Newest state tick passed on, spectators sync to the relay
+	double m_tickTime; ///< When it was passed on
 };
 
 #else
 
+#include <stdint.h>
+
 struct Client {
 
-	char getID() { return 0; }
+	uint16_t getID() { return 0; }
 
 };
 
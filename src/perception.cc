@@ -0,0 +1,141 @@
+#include <algorithm>
+#include <cmath>
+
+#include "perception.hh"
+
+const float Perception::CELL = 4.0f;
+
+namespace {
+	/// Fraction along the segment where it enters the box, -1 if it misses
+	float slab(const b2Vec2& a, const b2Vec2& b, float x1, float y1, float x2, float y2) {
+		float t0 = 0.0f, t1 = 1.0f;
+		const float lo[] = { x1, y1 }, hi[] = { x2, y2 }, p[] = { a.x, a.y }, d[] = { b.x - a.x, b.y - a.y };
+		for (int i = 0; i < 2; ++i) {
+			if (std::abs(d[i]) < 1e-6f) {
+				if (p[i] < lo[i] || p[i] > hi[i]) return -1.0f;
+				continue;
+			}
+			float ta = (lo[i] - p[i]) / d[i], tb = (hi[i] - p[i]) / d[i];
+			if (ta > tb) std::swap(ta, tb);
+			t0 = std::max(t0, ta);
+			t1 = std::min(t1, tb);
+			if (t0 > t1) return -1.0f;
+		}
+		return t0;
+	}
+
+	/// Closest body of the wanted kinds along a ray
+	struct RayCallback: public b2RayCastCallback {
+		RayCallback(const Perception::Query& q, Perception::Classify classify): q(q), classify(classify), fraction(1.0f), hit(0) { }
+		float32 ReportFixture(b2Fixture* fixture, const b2Vec2&, const b2Vec2&, float32 f) {
+			const b2Body* body = fixture->GetBody();
+			if (body == q.skip || fixture->IsSensor()) return -1;
+			unsigned kind = classify(body) & q.mask;
+			if (!kind) return -1;
+			fraction = f;
+			hit = kind;
+			return f;
+		}
+		const Perception::Query& q;
+		Perception::Classify classify;
+		float fraction;
+		unsigned hit;
+	};
+}
+
+
+void Perception::build(const Platforms& platforms, float w, float h) {
+	clear();
+	m_cols = std::max(1, int(std::ceil(w / CELL)));
+	m_rows = std::max(1, int(std::ceil(h / CELL)));
+	m_cells.resize(m_cols * m_rows);
+	for (Platforms::const_iterator it = platforms.begin(); it != platforms.end(); ++it) {
+		Box box = { it->getX() - it->getW() * 0.5f, it->getY() - it->getH() * 0.5f,
+		            it->getX() + it->getW() * 0.5f, it->getY() + it->getH() * 0.5f };
+		add(box);
+	}
+	// Borders, a tile thick outside the world
+	Box left = { -1.0f, -1.0f, 0.0f, h + 1.0f }, right = { w, -1.0f, w + 1.0f, h + 1.0f };
+	Box top = { -1.0f, -1.0f, w + 1.0f, 0.0f }, bottom = { -1.0f, h, w + 1.0f, h + 1.0f };
+	add(left); add(right); add(top); add(bottom);
+	m_seen.assign(m_boxes.size(), 0);
+}
+
+
+void Perception::clear() {
+	m_boxes.clear();
+	m_cells.clear();
+	m_seen.clear();
+	m_cols = m_rows = 0;
+	reset();
+}
+
+
+void Perception::add(const Box& box) {
+	unsigned i = m_boxes.size();
+	m_boxes.push_back(box);
+	int c1, r1, c2, r2;
+	cells(box.x1, box.y1, box.x2, box.y2, c1, r1, c2, r2);
+	for (int r = r1; r <= r2; ++r)
+		for (int c = c1; c <= c2; ++c) m_cells[r * m_cols + c].push_back(i);
+}
+
+
+void Perception::cells(float x1, float y1, float x2, float y2, int& c1, int& r1, int& c2, int& r2) const {
+	c1 = std::max(0, std::min(m_cols - 1, int(std::floor(x1 / CELL))));
+	c2 = std::max(0, std::min(m_cols - 1, int(std::floor(x2 / CELL))));
+	r1 = std::max(0, std::min(m_rows - 1, int(std::floor(y1 / CELL))));
+	r2 = std::max(0, std::min(m_rows - 1, int(std::floor(y2 / CELL))));
+}
+
+
+size_t Perception::ray(const b2Vec2& from, const b2Vec2& to, unsigned mask, const b2Body* skip) {
+	Query q = { mask, from, to, skip };
+	m_queries.push_back(q);
+	m_results.push_back(Result());
+	return m_queries.size() - 1;
+}
+
+
+void Perception::queryDynamic(const b2World& world, Classify classify) {
+	for (size_t i = 0; i < m_queries.size(); ++i) {
+		const Query& q = m_queries[i];
+		Result& r = m_results[i];
+		if ((q.b - q.a).LengthSquared() < 1e-12f) continue; // Box2D asserts on these
+		RayCallback callback(q, classify);
+		world.RayCast(&callback, q.a, q.b);
+		if (callback.hit && callback.fraction < r.fraction) {
+			r.fraction = callback.fraction;
+			r.hit = callback.hit;
+		}
+	}
+}
+
+
+void Perception::queryStatic() {
+	if (m_cells.empty()) return;
+	for (size_t i = 0; i < m_queries.size(); ++i) {
+		const Query& q = m_queries[i];
+		if (!(q.mask & LEVEL)) continue;
+		Result& r = m_results[i];
+		// Rays are short or nearly level, the cells under their bounds are few enough
+		int c1, r1, c2, r2;
+		cells(std::min(q.a.x, q.b.x), std::min(q.a.y, q.b.y), std::max(q.a.x, q.b.x), std::max(q.a.y, q.b.y), c1, r1, c2, r2);
+		if (++m_stamp == 0) { m_seen.assign(m_seen.size(), 0); m_stamp = 1; }
+		for (int row = r1; row <= r2; ++row) {
+			for (int col = c1; col <= c2; ++col) {
+				const std::vector<unsigned>& cell = m_cells[row * m_cols + col];
+				for (size_t j = 0; j < cell.size(); ++j) {
+					if (m_seen[cell[j]] == m_stamp) continue;
+					m_seen[cell[j]] = m_stamp;
+					const Box& b = m_boxes[cell[j]];
+					float f = slab(q.a, q.b, b.x1, b.y1, b.x2, b.y2);
+					if (f >= 0.0f && f < r.fraction) {
+						r.fraction = f;
+						r.hit = LEVEL;
+					}
+				}
+			}
+		}
+	}
+}
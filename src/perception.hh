@@ -0,0 +1,67 @@
+#pragma once
+
+#include <vector>
+#include <Box2D.h>
+
+#include "worldelements.hh"
+
+/// Ray queries from all AI actors of a tick, answered in one go.
+/// The level is static, so platforms and borders are looked up from a grid
+/// without the world lock; only moving things go through the Box2D broadphase.
+class Perception {
+  public:
+	/// What a query looks for
+	enum Kind { LEVEL = 1, CRATES = 2, ACTORS = 4, ALL = 7 };
+
+	struct Query {
+		unsigned mask;       ///< Kinds
+		b2Vec2 a;
+		b2Vec2 b;
+		const b2Body* skip;  ///< Usually the asking actor
+	};
+
+	struct Result {
+		Result(): fraction(1.0f), hit(0) { }
+		float fraction; ///< How far along the first hit is, 1 if clear
+		unsigned hit;   ///< Kind of the first hit
+	};
+
+	/// Kind of a body for the dynamic pass, 0 to ignore it
+	typedef unsigned (*Classify)(const b2Body* body);
+
+	Perception(): m_cols(0), m_rows(0), m_stamp(0) { }
+
+	/// Index the level, w and h are the world size
+	void build(const Platforms& platforms, float w, float h);
+	void clear();
+
+	/// Start a new batch, the previous results are dropped
+	void reset() { m_queries.clear(); m_results.clear(); }
+	/// Queue a query, returns its index in the results
+	size_t ray(const b2Vec2& from, const b2Vec2& to, unsigned mask, const b2Body* skip = NULL);
+	size_t size() const { return m_queries.size(); }
+
+	/// Answer the batch against moving bodies, under the world lock
+	void queryDynamic(const b2World& world, Classify classify);
+	/// Answer the batch against the level, needs no lock
+	void queryStatic();
+
+	const Query& query(size_t i) const { return m_queries[i]; }
+	const Result& operator[](size_t i) const { return m_results[i]; }
+
+  private:
+	struct Box { float x1, y1, x2, y2; };
+	static const float CELL;
+
+	void add(const Box& box);
+	/// Grid cells overlapping a box, clamped to the grid
+	void cells(float x1, float y1, float x2, float y2, int& c1, int& r1, int& c2, int& r2) const;
+
+	std::vector<Box> m_boxes;
+	std::vector<std::vector<unsigned> > m_cells; ///< Boxes overlapping each cell, row by row
+	std::vector<unsigned> m_seen; ///< Stamp per box, to test each only once per query
+	int m_cols, m_rows;
+	unsigned m_stamp;
+	std::vector<Query> m_queries;
+	std::vector<Result> m_results;
+};
@@ -1,24 +1,144 @@
 #include "player.hh"
+#include "world.hh"
+#include "perception.hh"
 
 /// Statics
 const std::string Actor::Names[] = { "Fresh", "Frozen", "Raw", "Roasted" };
-int Actor::ref_count = 0;
-int Actor::human_count = 0;
-
-
-void Actor::brains() {
-	static Countdown actiontimer(1.0);
-	static bool stopped = false;
-	if (actiontimer()) {
-		stopped = false;
-		if (randbool() && randbool() && randbool()) stopped = true;
-		if (ladder != LADDER_NO && randbool()) jump();
-		else move(randbool() ? -1 : 1);
-		actiontimer = Countdown(randf(0.5f, 1.5f));
-	} else if (!stopped) {
-		if (ladder != LADDER_NO && randbool()) jump();
-		else move(dir);
+std::atomic<int> Actor::ref_count(0);
+std::atomic<int> Actor::human_count(0);
+
+
+void Actor::sense(const AIView& view, const AIView::Body& self, Perception& senses) {
+	// In AISense order, answered before think runs
+	const unsigned solid = Perception::LEVEL | Perception::CRATES;
+	float d = ai.held.dir ? ai.held.dir : self.dir;
+	// Look where the chased actor is now, not where it was when picked
+	if (ai.has_target && ai.target_id) {
+		const AIView::Body* target = view.find(ai.target_id);
+		if (target && !target->dead && !target->invisible) ai.target = target->pos;
+		else ai.has_target = false;
 	}
+	// Without a target the first ray is a placeholder that is never cast
+	ai.target_sensed = ai.has_target;
+	if (ai.has_target) ai.senses = senses.ray(self.pos, ai.target, solid, self.body);
+	else ai.senses = senses.ray(self.pos, self.pos, 0, self.body);
+	senses.ray(self.pos, self.pos + b2Vec2(d * 0.8f, 0), solid, self.body);
+	senses.ray(self.pos + b2Vec2(d * 0.6f, 0), self.pos + b2Vec2(d * 0.6f, 3.0f), solid, self.body);
+}
+
+void Actor::think(const AIView& view, const NavGraph& nav, const Perception& senses) {
+	// Runs on a worker thread: only reads the view and the graph, only writes ai
+	const AIView::Body* self = view.find(id);
+	if (!self || self->dead) { ai.keys = AIKeys(); return; }
+	b2Vec2 pos = self->pos;
+	AIKeys& keys = ai.keys;
+	keys.up = keys.down = false;
+	keys.dir = 0;
+	if (ai.goal()) {
+		// Power-ups first, then the closest opponent
+		bool found = false;
+		float best = 0;
+		ai.target_id = 0;
+		if (self->powerup == Powerup::NONE) {
+			for (size_t i = 0; i < view.powerups.size(); ++i) {
+				float d = (view.powerups[i] - pos).LengthSquared();
+				if (!found || d < best) { ai.target = view.powerups[i]; best = d; found = true; }
+			}
+		}
+		if (!found) {
+			for (size_t i = 0; i < view.actors.size(); ++i) {
+				const AIView::Body& other = view.actors[i];
+				if (&other == self || other.dead || other.invisible) continue;
+				float d = (other.pos - pos).LengthSquared();
+				if (!found || d < best) { ai.target = other.pos; ai.target_id = other.id; best = d; found = true; }
+			}
+		}
+		ai.has_target = found;
+		// This tick's ray went to the previous target, if any
+		ai.target_sensed = false;
+		ai.path.clear();
+		if (found && nav.findPath(nav.nearest(pos), nav.nearest(ai.target), ai.path)) {
+			ai.next = 1;
+			ai.stuck = Countdown(3.0);
+		}
+		ai.goal = Countdown(randf(0.3f, 0.7f));
+	}
+	// Shoot whoever is in line
+	if (ai.target_sensed && self->powerup == Powerup::GUN && std::abs(ai.target.y - pos.y) < 0.4f && sign(ai.target.x - pos.x) == self->dir
+	  && senses[ai.senses + SENSE_TARGET].fraction >= 1.0f)
+		keys.action = true;
+	if (ai.path.empty() || ai.stuck()) {
+		if (ai.stuck() && !ai.path.empty()) {
+			// Hop and think again
+			ai.path.clear();
+			ai.goal = Countdown();
+			keys.up = true;
+			if (self->powerup == Powerup::TELEPORT) keys.action = true;
+			return;
+		}
+		wander(*self, senses);
+		return;
+	}
+	// At the goal node, go straight for the target
+	if (ai.next >= ai.path.size()) {
+		if (std::abs(ai.target.x - pos.x) > 0.25f) keys.dir = sign(ai.target.x - pos.x);
+		return;
+	}
+	const NavNode& to = nav.node(ai.path[ai.next]);
+	const NavEdge* edge = nav.edge(ai.path[ai.next - 1], ai.path[ai.next]);
+	b2Vec2 d = to.pos - pos;
+	if (std::abs(d.x) < 0.35f && std::abs(d.y) < 0.75f && (!self->airborne || self->on_ladder)) {
+		if (++ai.next >= ai.path.size()) return;
+		ai.stuck = Countdown(3.0);
+		edge = nav.edge(ai.path[ai.next - 1], ai.path[ai.next]);
+		d = nav.node(ai.path[ai.next]).pos - pos;
+	}
+	keys.dir = d.x > 0 ? 1 : -1;
+	switch (edge ? edge->type : NavEdge::WALK) {
+	case NavEdge::CLIMB:
+		if (!self->on_ladder) break;
+		keys.dir = 0;
+		keys.up = d.y < 0;
+		keys.down = d.y >= 0;
+		break;
+	case NavEdge::JUMP: {
+		// Take off from the edge and hold the jump for full height
+		const NavNode& from = nav.node(ai.path[ai.next - 1]);
+		keys.up = (!self->airborne && std::abs(from.pos.x - pos.x) < 0.4f) || (self->jumping > 0 && self->jumping < 5);
+		break;
+	} default:
+		break;
+	}
+}
+
+void Actor::wander(const AIView::Body& self, const Perception& senses) {
+	if (ai.wander()) {
+		ai.stopped = false;
+		if (randbool() && randbool() && randbool()) ai.stopped = true;
+		ai.keys.dir = randbool() ? -1 : 1;
+		ai.wander = Countdown(randf(0.5f, 1.5f));
+	} else if (!ai.stopped) {
+		// Keep going the way the senses looked: hop over walls, turn back at drops
+		ai.keys.dir = ai.held.dir ? ai.held.dir : self.dir;
+		if (senses[ai.senses + SENSE_WALL].hit) ai.keys.up = true;
+		else if (!self.airborne && !senses[ai.senses + SENSE_GROUND].hit) ai.keys.dir = -ai.keys.dir;
+	}
+	if (self.on_ladder && randbool()) ai.keys.up = true;
+	if (ai.stopped) ai.keys.dir = 0;
+}
+
+void Actor::handle_ai() {
+	if (type != Actor::AI || is_dead()) return;
+	// Same as handle_keys, releases like key_state
+	const AIKeys& k = ai.keys;
+	if (k.dir) move(k.dir);
+	else if (ai.held.dir) stop();
+	if (k.up) jump();
+	else if (k.down) duck();
+	else if (ai.held.up || ai.held.down || (!airborne && ladder == LADDER_NO && jumping)) end_jumping();
+	if (k.action) ai.action = true;
+	ai.keys.action = false;
+	ai.held = k;
 }
 
 void Actor::move(int direction) {
@@ -92,13 +212,21 @@ void Actor::end_jumping() {
 
 void Actor::key_state(int k, bool pressed) {
 	if (type != Actor::HUMAN || is_dead()) return;
+	unsigned ev = 0;
 	// Action button doesn't require state tracking
-	if (k == KEY_ACTION && pressed) action();
+	if (k == KEY_ACTION && pressed) ev = InputFrame::ACTION;
 	// Movement keys use state tracking
-	else if (k == KEY_UP) { if (!pressed && key_up) end_jumping(); key_up = pressed; }
-	else if (k == KEY_DOWN) { if (!pressed && key_down) end_jumping(); key_down = pressed; }
-	else if (k == KEY_LEFT) { if (!pressed && key_left) stop(); key_left = pressed; }
-	else if (k == KEY_RIGHT) { if (!pressed && key_right) stop(); key_right = pressed; }
+	else if (k == KEY_UP) { if (!pressed && key_up) ev = InputFrame::STOP_JUMPING; key_up = pressed; }
+	else if (k == KEY_DOWN) { if (!pressed && key_down) ev = InputFrame::STOP_JUMPING; key_down = pressed; }
+	else if (k == KEY_LEFT) { if (!pressed && key_left) ev = InputFrame::STOP_MOVING; key_left = pressed; }
+	else if (k == KEY_RIGHT) { if (!pressed && key_right) ev = InputFrame::STOP_MOVING; key_right = pressed; }
+	if (!ev) return;
+	if (defer_keys) key_events |= ev;
+	else {
+		InputFrame f;
+		f.events = ev;
+		applyInput(f);
+	}
 }
 
 void Actor::handle_keys() {
@@ -108,3 +236,24 @@ void Actor::handle_keys() {
 	if (key_up) jump();
 	else if (key_down) duck();
 }
+
+InputFrame Actor::takeKeys() {
+	InputFrame f;
+	f.events = key_events.exchange(0);
+	if (key_left) f.buttons |= InputFrame::LEFT;
+	else if (key_right) f.buttons |= InputFrame::RIGHT;
+	if (key_up) f.buttons |= InputFrame::UP;
+	else if (key_down) f.buttons |= InputFrame::DOWN;
+	return f;
+}
+
+void Actor::applyInput(const InputFrame& f) {
+	// Edge-triggered events happened before the held state of this frame
+	if (f.events & InputFrame::STOP_MOVING) stop();
+	if (f.events & InputFrame::STOP_JUMPING) end_jumping();
+	if (f.events & InputFrame::ACTION) action();
+	if (f.buttons & InputFrame::LEFT) move(-1);
+	else if (f.buttons & InputFrame::RIGHT) move(1);
+	if (f.buttons & InputFrame::UP) jump();
+	else if (f.buttons & InputFrame::DOWN) duck();
+}
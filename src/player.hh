@@ -2,6 +2,7 @@
 
 #include <iostream>
 #include <algorithm>
+#include <atomic>
 #include <GL/gl.h>
 #include <Box2D.h>
 #include <boost/ptr_container/ptr_vector.hpp>
@@ -11,7 +12,9 @@
 #include "texture.hh"
 #include "entity.hh"
 #include "powerups.hh"
+#include "input.hh"
 #include "network.hh"
+#include "ai.hh"
 
 #define PLAYER_RESTITUTION 0.25f
 #define PLAYER_FRICTION 0.2f
@@ -35,26 +38,27 @@ struct Points {
 };
 
 class World;
+class NavGraph;
+class Perception;
 
 class Actor: public boost::noncopyable, public Entity {
-	static int ref_count;
-	static int human_count;
+	// Worlds run in parallel when self-playing
+	static std::atomic<int> ref_count;
+	static std::atomic<int> human_count;
 
   public:
 	enum Type { HUMAN, AI, REMOTE } const type;
 	static const std::string Names[NAMES];
 
 	Actor(GLuint tex = 0, Type t = HUMAN): Entity(tex), type(t),
-	  key_up(), key_down(), key_left(), key_right(), key_action(),
+	  key_up(), key_down(), key_left(), key_right(), key_action(), defer_keys(false), key_events(0), id(0), view_tick(0),
 	  points(), dead(false), dir(-1), anim_frame(0), airborne(true), ladder(LADDER_NO), jumping(0), jump_dir(0),
 	  wallpenalty(0), powerup(), respawn(), invisible(false), doublejump(DJUMP_DISALLOW), reversecontrols(false), lograv(false)
 	{
-		name = Names[ref_count % NAMES];
-		++ref_count;
-		if (type == HUMAN) {
-			keys_id = human_count;
-			++human_count;
-		}
+		int n = ref_count++;
+		name = Names[n % NAMES];
+		if (n >= NAMES) name += " " + num2str(n / NAMES + 1);
+		if (type == HUMAN) keys_id = human_count++;
 	}
 
 	~Actor() {
@@ -62,7 +66,13 @@ class Actor: public boost::noncopyable, public Entity {
 		if (type == HUMAN) --human_count;
 	}
 
-	void brains();
+	/// Queue the perception queries think will need
+	void sense(const AIView& view, const AIView::Body& self, Perception& senses);
+	/// Decide which keys to hold, may run on any thread
+	void think(const AIView& view, const NavGraph& nav, const Perception& senses);
+	/// Press the keys think decided on, every tick like handle_keys
+	void handle_ai();
+	void wander(const AIView::Body& self, const Perception& senses);
 
 	virtual void move(int direction);
 	virtual void jump(bool forcejump = false);
@@ -94,10 +104,12 @@ class Actor: public boost::noncopyable, public Entity {
 		return se;
 	}
 
-	virtual void unserialize(std::string data) {
-		Entity::unserialize(data);
-		SerializedEntity* se = reinterpret_cast<SerializedEntity*>(&data[0]);
-		dir = se->type;
+	virtual void unserialize(const SerializedEntity& se) {
+		// Invisible actors are sent as a marker without their position
+		invisible = se.flags & SerializedEntity::HIDDEN;
+		if (invisible) return;
+		Entity::unserialize(se);
+		dir = se.type;
 	}
 
 	bool is_dead() const { return dead; }
@@ -107,7 +119,12 @@ class Actor: public boost::noncopyable, public Entity {
 	std::string getName() const { return name; }
 
 	void key_state(int k, bool pressed);
-	void handle_keys();
+	virtual void handle_keys();
+	/// Held keys and the key events since the last call, for worlds that
+	/// apply local input at tick boundaries
+	InputFrame takeKeys();
+	/// Act on one input frame the same way key_state / handle_keys would
+	void applyInput(const InputFrame& f);
 
 	int KEY_UP;
 	int KEY_DOWN;
@@ -120,9 +137,13 @@ class Actor: public boost::noncopyable, public Entity {
 	bool key_left;
 	bool key_right;
 	bool key_action;
+	bool defer_keys; ///< key_state only queues events for takeKeys
+	std::atomic<unsigned> key_events; ///< InputFrame::Event bits, set from the input thread
 
 	int keys_id;
 	std::string name;
+	uint16_t id; ///< Same on the server and all clients
+	uint32_t view_tick; ///< Server only: state tick the remote player saw while acting, 0 for now
 
 	// Flags / states
 	Points points;
@@ -136,6 +157,7 @@ class Actor: public boost::noncopyable, public Entity {
 	Countdown wallpenalty;
 	Powerup powerup;
 	Countdown respawn;
+	AIState ai;
 
 	// Power-up attributes
 	bool invisible;
@@ -151,52 +173,49 @@ typedef boost::ptr_vector<Actor> Players;
 class OnlinePlayer: public Actor {
   public:
 
-	// These are sent to the server indicating player's action
-	enum Action {
-		MOVE_LEFT = 1,
-		MOVE_RIGHT,
-		JUMP,
-		DUCK,
-		STOP_MOVING,
-		STOP_JUMPING,
-		ACTION
-	};
-
 	OnlinePlayer(Client* client, GLuint tex = 0, Type t = HUMAN): Actor(tex, t), client(client) { }
 
 #ifdef USE_NETWORK
 
+	// Actions are only recorded into the current input frame here,
+	// handle_keys() sends the frame to the server once per tick.
+
 	virtual void move(int direction) {
-		if (direction < 0) client->send(MOVE_LEFT);
-		else if (direction > 0) client->send(MOVE_RIGHT);
+		if (direction < 0) client->input(InputFrame::LEFT);
+		else if (direction > 0) client->input(InputFrame::RIGHT);
 		Actor::move(direction);
 	}
 
 	virtual void stop() {
-		client->send(STOP_MOVING);
+		client->input(0, InputFrame::STOP_MOVING);
 		Actor::stop();
 	}
 
 	virtual void jump(bool forcejump = false) {
-		client->send(JUMP);
+		client->input(InputFrame::UP);
 		Actor::jump(forcejump);
 	}
 
 	virtual void duck() {
-		client->send(DUCK);
+		client->input(InputFrame::DOWN);
 		Actor::duck();
 	}
 
 	virtual void end_jumping() {
-		client->send(STOP_JUMPING);
+		client->input(0, InputFrame::STOP_JUMPING);
 		Actor::end_jumping();
 	}
 
 	virtual void action() {
-		client->send(ACTION);
+		client->input(0, InputFrame::ACTION);
 		// Don't do the action locally, it probably just breaks things
 	}
 
+	virtual void handle_keys() {
+		Actor::handle_keys();
+		client->sendInput();
+	}
+
 #endif
 
   private:
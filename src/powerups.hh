@@ -42,11 +42,9 @@ struct PowerupEntity: public Entity {
 		return se;
 	}
 
-	virtual void unserialize(std::string data) {
-		SerializedEntity* se;
-		se = reinterpret_cast<SerializedEntity*>(&data[0]);
-		effect.type = Powerup::PowerupTypes[(int)se->type];
-		Entity::unserialize(data);
+	virtual void unserialize(const SerializedEntity& se) {
+		effect.type = Powerup::PowerupTypes[(int)se.type];
+		Entity::unserialize(se);
 	}
 
 	Powerup effect;
@@ -0,0 +1,159 @@
+#include <chrono>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+
+#include "profiler.hh"
+#ifdef USE_THREADS
+#include <boost/thread/mutex.hpp>
+#endif
+
+#ifdef USE_THREADS
+	#define LOCKPROFILER boost::mutex::scoped_lock lock(registry_mutex)
+#else
+	#define LOCKPROFILER
+#endif
+
+std::atomic<bool> Profiler::s_active(false);
+
+namespace {
+	static const size_t RING_SIZE = 1 << 15; // Zones per thread, the latest ones are kept
+
+	struct Zone {
+		const char* name;
+		uint64_t start;
+		uint64_t end;
+	};
+
+	/// Written by its own thread only. Dumps copy it from another thread and
+	/// drop whatever the writer may have overwritten meanwhile.
+	struct Ring {
+		Ring(unsigned tid): tid(tid), head(0), zones(RING_SIZE) { }
+		unsigned tid;
+		std::string name;
+		std::atomic<uint64_t> head; ///< Zones ever recorded
+		std::vector<Zone> zones;
+	};
+
+	#ifdef USE_THREADS
+	boost::mutex registry_mutex;
+	#endif
+	std::vector<Ring*> rings; // Never freed, the zones of finished threads still go in traces
+	std::atomic<uint64_t> since(0); // Latest start
+
+	Ring*& threadRing() { static thread_local Ring* r = NULL; return r; }
+	/// Given before the thread recorded anything, rings only exist once it has
+	std::string& threadName() { static thread_local std::string name; return name; }
+
+	Ring* ring() {
+		Ring*& r = threadRing();
+		if (!r) {
+			LOCKPROFILER;
+			r = new Ring(rings.size() + 1);
+			r->name = threadName();
+			rings.push_back(r);
+		}
+		return r;
+	}
+
+	/// Names are code literals or thread names, only quotes and backslashes need care
+	std::string escape(const std::string& s) {
+		std::string out;
+		for (size_t i = 0; i < s.size(); ++i) {
+			if (s[i] == '"' || s[i] == '\\') out += '\\';
+			out += s[i];
+		}
+		return out;
+	}
+}
+
+
+void Profiler::start() {
+	since = now();
+	s_active = true;
+}
+
+
+void Profiler::stop() {
+	s_active = false;
+}
+
+
+void Profiler::nameThread(const std::string& name) {
+	threadName() = name;
+	Ring* r = threadRing();
+	if (!r) return;
+	LOCKPROFILER;
+	r->name = name;
+}
+
+
+uint64_t Profiler::now() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+void Profiler::record(const char* name, uint64_t start, uint64_t end) {
+	Ring* r = ring();
+	uint64_t h = r->head.load(std::memory_order_relaxed);
+	Zone& z = r->zones[h % RING_SIZE];
+	z.name = name;
+	z.start = start;
+	z.end = end;
+	r->head.store(h + 1, std::memory_order_release);
+}
+
+
+size_t Profiler::dump(const std::string& filename) {
+	std::ofstream file(filename.c_str());
+	if (!file) throw std::runtime_error("Cannot write trace " + filename);
+	std::vector<Ring*> all;
+	{
+		LOCKPROFILER;
+		all = rings;
+	}
+	uint64_t from = since;
+	size_t count = 0;
+	std::vector<Zone> copy;
+	file << std::fixed << std::setprecision(3); // Microseconds
+	file << "{\"traceEvents\":[" << std::endl;
+	file << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"" << PACKAGE << "\"}}";
+	for (size_t i = 0; i < all.size(); ++i) {
+		Ring& r = *all[i];
+		std::string name;
+		{
+			LOCKPROFILER;
+			name = r.name.empty() ? "thread " + std::to_string(r.tid) : r.name;
+		}
+		file << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << r.tid
+		  << ",\"args\":{\"name\":\"" << escape(name) << "\"}}";
+		uint64_t before = r.head.load(std::memory_order_acquire);
+		uint64_t first = before > RING_SIZE ? before - RING_SIZE : 0;
+		copy.clear();
+		for (uint64_t j = first; j < before; ++j) copy.push_back(r.zones[j % RING_SIZE]);
+		// Zones the writer lapped while copying are torn, and so may be the
+		// one it is writing into the slot at head before publishing it
+		uint64_t after = r.head.load(std::memory_order_acquire);
+		uint64_t valid = after + 1 > RING_SIZE ? after + 1 - RING_SIZE : 0;
+		for (uint64_t j = std::max(first, valid); j < before; ++j) {
+			const Zone& z = copy[j - first];
+			if (z.start < from) continue;
+			file << ",\n{\"name\":\"" << escape(z.name) << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << r.tid
+			  << ",\"ts\":" << (z.start - from) / 1000.0 << ",\"dur\":" << (z.end - z.start) / 1000.0 << "}";
+			++count;
+		}
+	}
+	file << "\n]}" << std::endl;
+	return count;
+}
+
+
+std::string Profiler::traceFilename() {
+	char name[64];
+	std::time_t t = std::time(NULL);
+	std::strftime(name, sizeof(name), "trace-%Y%m%d-%H%M%S.json", std::localtime(&t));
+	return name;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include "config.hh"
+
+#include <string>
+#include <atomic>
+#include <stdint.h>
+
+/// Scoped timing zones, kept in a ring per thread and written out as a
+/// Chrome trace for chrome://tracing or Perfetto. Zones nest by time, so the
+/// trace shows e.g. update / step inside the tick that ran it. Without
+/// USE_PROFILER the zones compile to nothing; with it a zone costs one
+/// relaxed load while recording is off.
+class Profiler {
+  public:
+	/// Record from now on, a dump only holds zones since the latest start
+	static void start();
+	static void stop();
+	static bool active() { return s_active.load(std::memory_order_relaxed); }
+	/// Name of the calling thread in traces
+	static void nameThread(const std::string& name);
+	/// Write the zones the rings still hold as Chrome trace JSON,
+	/// returns how many. Safe while other threads keep recording.
+	static size_t dump(const std::string& filename);
+	/// Name for a new trace in the working directory
+	static std::string traceFilename();
+
+	/// Nanoseconds on a monotonic clock
+	static uint64_t now();
+	/// Append a finished zone to the calling thread's ring
+	static void record(const char* name, uint64_t start, uint64_t end);
+
+  private:
+	static std::atomic<bool> s_active;
+};
+
+
+/// Times its scope while the profiler is recording, see PROFILE
+class ProfileZone {
+  public:
+	ProfileZone(const char* name): m_name(Profiler::active() ? name : NULL), m_start(m_name ? Profiler::now() : 0) { }
+	~ProfileZone() { if (m_name) Profiler::record(m_name, m_start, Profiler::now()); }
+	/// End this zone and start another one in its place
+	void next(const char* name) {
+		uint64_t t = m_name ? Profiler::now() : 0;
+		if (m_name) Profiler::record(m_name, m_start, t);
+		m_name = Profiler::active() ? name : NULL;
+		m_start = m_name ? (t ? t : Profiler::now()) : 0;
+	}
+  private:
+	ProfileZone(const ProfileZone&);
+	ProfileZone& operator=(const ProfileZone&);
+	const char* m_name; ///< A literal, only the pointer is kept
+	uint64_t m_start;
+};
+
+#define PROFILE_CONCAT2(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT2(a, b)
+
+#ifdef USE_PROFILER
+/// Time the rest of the enclosing scope under the given name
+#define PROFILE(name) ProfileZone PROFILE_CONCAT(profile_zone_, __LINE__)(name)
+/// Like PROFILE, but PROFILE_NEXT splits the rest of the scope into consecutive zones
+#define PROFILE_SECTION(name) ProfileZone profile_section(name)
+#define PROFILE_NEXT(name) profile_section.next(name)
+#else
+#define PROFILE(name) do { } while (0)
+#define PROFILE_SECTION(name) do { } while (0)
+#define PROFILE_NEXT(name) do { } while (0)
+#endif
@@ -0,0 +1,348 @@
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+#include <iterator>
+#include <stdexcept>
+
+#include "replay.hh"
+#include "world.hh"
+#include "settings.hh"
+#include "filesystem.hh"
+#include "profiler.hh"
+
+#ifdef USE_THREADS
+	#define LOCKREPLAY boost::mutex::scoped_lock lock(m_mutex)
+#else
+	#define LOCKREPLAY
+#endif
+
+namespace {
+	static const char MAGIC[] = { 'T', 'M', 'R', 'P' };
+	static const uint16_t FORMAT_VERSION = 2;
+	static const size_t HEADER_SIZE = 10;
+	static const size_t CHUNK_HEADER_SIZE = 9;
+	static const size_t MAX_PENDING = 1000; // Snapshots are dropped beyond this if the disk can't keep up
+
+	void putU32(std::vector<char>& out, uint32_t v) {
+		for (int i = 0; i < 4; ++i) out.push_back(char(v >> (i * 8)));
+	}
+
+	uint32_t getU32(const char* p) {
+		const unsigned char* u = reinterpret_cast<const unsigned char*>(p);
+		return u[0] | (u[1] << 8) | (u[2] << 16) | (uint32_t(u[3]) << 24);
+	}
+
+	/// FNV-1a of a buffer, to compare worlds by their snapshots
+	uint32_t hashBytes(const std::vector<char>& data, size_t size) {
+		uint32_t h = 2166136261u;
+		for (size_t i = 0; i < size; ++i) h = (h ^ uint8_t(data[i])) * 16777619u;
+		return h;
+	}
+
+	/// Hash of everything that moves, sizing buf as needed
+	uint32_t worldHash(const World& world, std::vector<char>& buf) {
+		size_t size;
+		while ((size = world.serialize(&buf[0], buf.size())) > buf.size()) buf.resize(size);
+		return hashBytes(buf, size);
+	}
+
+	void putVarint(std::vector<char>& out, size_t v) {
+		while (v >= 0x80) { out.push_back(char(v | 0x80)); v >>= 7; }
+		out.push_back(char(v));
+	}
+
+	size_t getVarint(const char* buf, size_t size, size_t& pos) {
+		size_t v = 0;
+		for (int shift = 0; pos < size && shift < 32; shift += 7) {
+			unsigned char c = buf[pos++];
+			v |= size_t(c & 0x7F) << shift;
+			if (!(c & 0x80)) break;
+		}
+		return v;
+	}
+
+	/// XOR against the previous frame, stored as alternating zero and literal runs
+	void encodeDelta(const std::vector<char>& prev, const std::vector<char>& cur, std::vector<char>& out) {
+		out.clear();
+		putVarint(out, cur.size());
+		size_t i = 0;
+		while (i < cur.size()) {
+			size_t zeros = 0, literals = 0;
+			while (i + zeros < cur.size() && i + zeros < prev.size() && cur[i + zeros] == prev[i + zeros]) ++zeros;
+			size_t lit = i + zeros;
+			while (lit + literals < cur.size() && (lit + literals >= prev.size() || cur[lit + literals] != prev[lit + literals]))
+				++literals;
+			putVarint(out, zeros);
+			putVarint(out, literals);
+			for (size_t j = lit; j < lit + literals; ++j) out.push_back(cur[j] ^ (j < prev.size() ? prev[j] : 0));
+			i = lit + literals;
+		}
+	}
+
+	void decodeDelta(const char* buf, size_t size, std::vector<char>& frame) {
+		size_t pos = 0;
+		size_t len = getVarint(buf, size, pos);
+		frame.resize(len, 0);
+		size_t i = 0;
+		while (i < len && pos < size) {
+			i += getVarint(buf, size, pos);
+			size_t literals = getVarint(buf, size, pos);
+			for (size_t j = 0; j < literals && i < len && pos < size; ++j) frame[i++] ^= buf[pos++];
+		}
+	}
+}
+
+
+ReplayWriter::ReplayWriter(const std::string& filename, const World& world, float keyframe_interval):
+  m_file(filename.c_str(), std::ios::binary), m_keyframeInterval(std::max(1, int(keyframe_interval * REPLAY_TICKRATE))),
+  m_lastKeyframe(0), m_snapshot(1024), m_quit(false)
+{
+	if (!m_file) throw std::runtime_error("Cannot write replay " + filename);
+	std::vector<char> level(4096);
+	size_t size;
+	while ((size = world.serialize(&level[0], level.size(), false)) > level.size()) level.resize(size);
+	level.resize(size);
+	std::vector<char> header(MAGIC, MAGIC + sizeof(MAGIC));
+	header.push_back(char(FORMAT_VERSION & 0xFF));
+	header.push_back(char(FORMAT_VERSION >> 8));
+	putU32(header, level.size());
+	m_file.write(&header[0], header.size());
+	if (!level.empty()) m_file.write(&level[0], level.size());
+	#ifdef USE_THREADS
+	m_thread = boost::thread(boost::bind(&ReplayWriter::run, boost::ref(*this)));
+	#endif
+}
+
+
+ReplayWriter::~ReplayWriter() {
+	#ifdef USE_THREADS
+	{
+		LOCKREPLAY;
+		m_quit = true;
+		m_cond.notify_one();
+	}
+	m_thread.join();
+	#endif
+	m_file.flush();
+}
+
+
+void ReplayWriter::event(const GameEvent& ev) {
+	LOCKREPLAY;
+	m_events.push_back(ev);
+}
+
+
+void ReplayWriter::frame(const World& world) {
+	PROFILE("replay frame");
+	size_t size;
+	while ((size = world.serialize(&m_snapshot[0], m_snapshot.size())) > m_snapshot.size()) m_snapshot.resize(size);
+	uint32_t tick = world.getTick();
+	LOCKREPLAY;
+	if (world.isDeterministic()) {
+		m_pending.push_back(Pending());
+		Pending& p = m_pending.back();
+		p.type = REPLAY_HASH;
+		p.tick = tick;
+		putU32(p.data, world.getStateHash());
+	}
+	if (!m_events.empty()) {
+		m_pending.push_back(Pending());
+		Pending& p = m_pending.back();
+		p.type = REPLAY_EVENTS;
+		p.tick = tick;
+		p.data.resize(m_events.size() * EVENT_SIZE);
+		for (size_t i = 0; i < m_events.size(); ++i) encodeEvent(m_events[i], &p.data[i * EVENT_SIZE]);
+		m_events.clear();
+	}
+	// A dropped snapshot only makes the next delta larger
+	if (m_pending.size() < MAX_PENDING) {
+		m_pending.push_back(Pending());
+		Pending& p = m_pending.back();
+		p.type = REPLAY_KEYFRAME;
+		p.tick = tick;
+		if (!m_free.empty()) { p.data.swap(m_free.back()); m_free.pop_back(); }
+		p.data.assign(m_snapshot.begin(), m_snapshot.begin() + size);
+	}
+	#ifdef USE_THREADS
+	m_cond.notify_one();
+	#else
+	for (; !m_pending.empty(); m_pending.pop_front()) process(m_pending.front());
+	#endif
+}
+
+
+#ifdef USE_THREADS
+void ReplayWriter::run() {
+	Profiler::nameThread("replay");
+	boost::mutex::scoped_lock lock(m_mutex);
+	while (true) {
+		while (m_pending.empty() && !m_quit) m_cond.wait(lock);
+		if (m_pending.empty()) break;
+		Pending p;
+		p.type = m_pending.front().type;
+		p.tick = m_pending.front().tick;
+		p.data.swap(m_pending.front().data);
+		m_pending.pop_front();
+		bool idle = m_pending.empty();
+		lock.unlock();
+		process(p);
+		if (idle) m_file.flush();
+		lock.lock();
+		m_free.push_back(std::vector<char>());
+		m_free.back().swap(p.data);
+	}
+}
+#endif
+
+
+void ReplayWriter::process(Pending& p) {
+	PROFILE("replay write");
+	if (p.type == REPLAY_EVENTS || p.type == REPLAY_HASH) {
+		writeChunk(p.type, p.tick, p.data);
+		return;
+	}
+	if (m_prev.empty() || p.tick - m_lastKeyframe >= m_keyframeInterval) {
+		writeChunk(REPLAY_KEYFRAME, p.tick, p.data);
+		m_lastKeyframe = p.tick;
+	} else {
+		encodeDelta(m_prev, p.data, m_delta);
+		writeChunk(REPLAY_DELTA, p.tick, m_delta);
+	}
+	m_prev.swap(p.data); // The old one gets recycled
+}
+
+
+void ReplayWriter::writeChunk(char type, uint32_t tick, const std::vector<char>& data) {
+	std::vector<char> header(1, type);
+	putU32(header, tick);
+	putU32(header, data.size());
+	m_file.write(&header[0], header.size());
+	if (!data.empty()) m_file.write(&data[0], data.size());
+}
+
+
+ReplayReader::ReplayReader(const std::string& filename): m_next(0), m_tick(0) {
+	std::ifstream file(filename.c_str(), std::ios::binary);
+	if (!file) throw std::runtime_error("Cannot open replay " + filename);
+	m_data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+	if (m_data.size() < HEADER_SIZE || !std::equal(MAGIC, MAGIC + sizeof(MAGIC), m_data.begin()))
+		throw std::runtime_error(filename + " is not a replay file");
+	if (uint16_t(uint8_t(m_data[4]) | (uint8_t(m_data[5]) << 8)) != FORMAT_VERSION)
+		throw std::runtime_error(filename + " was recorded with an incompatible version");
+	size_t pos = HEADER_SIZE + getU32(&m_data[6]);
+	if (pos > m_data.size()) throw std::runtime_error(filename + " is truncated");
+	m_level.assign(m_data.begin() + HEADER_SIZE, m_data.begin() + pos);
+	// Index the chunks, a truncated one at the end is ignored
+	while (pos + CHUNK_HEADER_SIZE <= m_data.size()) {
+		Entry e;
+		e.type = m_data[pos];
+		e.tick = getU32(&m_data[pos + 1]);
+		e.size = getU32(&m_data[pos + 5]);
+		e.offset = pos + CHUNK_HEADER_SIZE;
+		if (e.offset + e.size > m_data.size()) break;
+		if (e.type == REPLAY_KEYFRAME) m_keyframes.push_back(m_index.size());
+		if (e.type == REPLAY_HASH && e.size >= 4) m_hashes.push_back(std::make_pair(e.tick, getU32(&m_data[e.offset])));
+		m_index.push_back(e);
+		pos = e.offset + e.size;
+	}
+	if (m_keyframes.empty()) throw std::runtime_error(filename + " has no frames");
+	m_tick = firstTick();
+}
+
+
+void ReplayReader::seek(World& world, uint32_t tick) {
+	// Latest keyframe at or before the target
+	size_t k = 0;
+	while (k + 1 < m_keyframes.size() && m_index[m_keyframes[k + 1]].tick <= tick) ++k;
+	// Decode forward when playing, jump when seeking
+	bool jump = tick < m_tick || (tick - m_tick > REPLAY_TICKRATE && m_keyframes[k] > m_next);
+	if (jump) {
+		// Joins and leaves in between are skipped, the keyframe alone says who is there
+		m_next = m_keyframes[k];
+		world.clearActors();
+	}
+	bool changed = false;
+	while (m_next < m_index.size() && m_index[m_next].tick <= tick) {
+		const Entry& e = m_index[m_next++];
+		const char* p = &m_data[e.offset];
+		switch (e.type) {
+		case REPLAY_KEYFRAME: m_frame.assign(p, p + e.size); changed = true; break;
+		case REPLAY_DELTA: decodeDelta(p, e.size, m_frame); changed = true; break;
+		case REPLAY_EVENTS:
+			// Skipped ones would only spam the log
+			for (size_t i = 0; !jump && (i + 1) * EVENT_SIZE <= e.size; ++i)
+				world.applyEvent(decodeEvent(reinterpret_cast<const unsigned char*>(p + i * EVENT_SIZE)));
+			break;
+		}
+		m_tick = e.tick;
+	}
+	// Only the newest frame needs to reach the world
+	if (changed && !m_frame.empty()) world.update(&m_frame[0], m_frame.size());
+}
+
+
+uint32_t ReplayReader::prevKeyframe(uint32_t tick) const {
+	uint32_t found = firstTick();
+	for (size_t i = 0; i < m_keyframes.size() && m_index[m_keyframes[i]].tick < tick; ++i)
+		found = m_index[m_keyframes[i]].tick;
+	return found;
+}
+
+
+uint32_t ReplayReader::nextKeyframe(uint32_t tick) const {
+	for (size_t i = 0; i < m_keyframes.size(); ++i)
+		if (m_index[m_keyframes[i]].tick > tick) return m_index[m_keyframes[i]].tick;
+	return lastTick();
+}
+
+
+std::vector<uint32_t> checkSeeking(ReplayReader& replay, World& world) {
+	std::vector<char> buf(4096);
+	std::vector<std::pair<uint32_t, uint32_t> > played; // Keyframe tick and world hash
+	uint32_t keyframe = replay.firstTick();
+	for (uint32_t tick = replay.firstTick(); tick <= replay.lastTick(); ++tick) {
+		replay.seek(world, tick);
+		if (tick != keyframe) continue;
+		played.push_back(std::make_pair(tick, worldHash(world, buf)));
+		keyframe = replay.nextKeyframe(tick);
+		if (keyframe == tick) break;
+	}
+	std::vector<uint32_t> differ;
+	for (size_t i = played.size(); i-- > 0; ) {
+		replay.seek(world, played[i].first);
+		if (worldHash(world, buf) != played[i].second) differ.push_back(played[i].first);
+	}
+	std::reverse(differ.begin(), differ.end());
+	return differ;
+}
+
+
+uint32_t firstDesync(const StateHashes& a, const StateHashes& b) {
+	// Hashes of the ticks both runs have, in order
+	StateHashes common;
+	std::vector<uint32_t> other;
+	for (size_t i = 0, j = 0; i < a.size() && j < b.size(); ) {
+		if (a[i].first < b[j].first) ++i;
+		else if (b[j].first < a[i].first) ++j;
+		else { common.push_back(a[i++]); other.push_back(b[j++].second); }
+	}
+	if (common.empty() || common.back().second == other.back()) return 0;
+	size_t lo = 0, hi = common.size() - 1; // First mismatch is in [lo, hi]
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if (common[mid].second == other[mid]) lo = mid + 1;
+		else hi = mid;
+	}
+	return common[lo].first;
+}
+
+
+std::string replayFilename() {
+	fs::path dir(config_replay_directory);
+	fs::create_directories(dir);
+	char name[64];
+	std::time_t t = std::time(NULL);
+	std::strftime(name, sizeof(name), "%Y%m%d-%H%M%S.replay", std::localtime(&t));
+	return (dir / name).string();
+}
@@ -0,0 +1,130 @@
+#pragma once
+
+#include "config.hh"
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <utility>
+#include <fstream>
+#include <stdint.h>
+#include <boost/noncopyable.hpp>
+#ifdef USE_THREADS
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#endif
+
+#include "events.hh"
+
+/// Simulation ticks per second, see World::update
+#define REPLAY_TICKRATE 100
+
+class World;
+
+/// Replay file layout, all integers little-endian:
+///   "TMRP", format version (u16), level size (u32), full world with the level
+///   chunks of type (u8), tick (u32), payload size (u32), payload
+/// Keyframes hold the dynamic world as World::serialize() writes it. Deltas
+/// hold the previous frame XORed with the current one, runs of zeros collapsed.
+/// Events use the same encoding as on the network. Deterministic worlds add
+/// the state hash (u32) of every tick, readers not knowing it skip it.
+enum ReplayChunk { REPLAY_KEYFRAME = 1, REPLAY_DELTA, REPLAY_EVENTS, REPLAY_HASH };
+
+/// State hashes of consecutive ticks, see World::getStateHash
+typedef std::vector<std::pair<uint32_t, uint32_t> > StateHashes;
+
+
+/// Records a match. The simulation thread only copies the snapshot,
+/// delta coding and file output happen on a thread of their own.
+class ReplayWriter: public boost::noncopyable {
+  public:
+	ReplayWriter(const std::string& filename, const World& world, float keyframe_interval = 5.0f);
+	~ReplayWriter();
+
+	/// Record the dynamic world after a tick
+	void frame(const World& world);
+	/// Record a gameplay event, recorded with the next frame
+	void event(const GameEvent& ev);
+
+  private:
+	/// Snapshot or events waiting to be written
+	struct Pending {
+		char type; ///< REPLAY_KEYFRAME for snapshots, the writer decides which ones stay full
+		uint32_t tick;
+		std::vector<char> data;
+	};
+
+	void run();
+	void process(Pending& p);
+	void writeChunk(char type, uint32_t tick, const std::vector<char>& data);
+
+	std::ofstream m_file;
+	unsigned m_keyframeInterval; ///< Ticks
+	uint32_t m_lastKeyframe;
+	std::vector<char> m_prev; ///< Previous snapshot, for deltas
+	std::vector<char> m_delta;
+	std::vector<char> m_snapshot; ///< Simulation thread's serialization buffer
+	std::vector<std::vector<char> > m_free; ///< Recycled buffers
+	std::deque<Pending> m_pending;
+	GameEvents m_events; ///< Since the last frame
+	bool m_quit;
+	#ifdef USE_THREADS
+	boost::mutex m_mutex;
+	boost::condition_variable m_cond;
+	boost::thread m_thread;
+	#endif
+};
+
+
+/// Plays back a recorded match into a World
+class ReplayReader: public boost::noncopyable {
+  public:
+	ReplayReader(const std::string& filename);
+
+	/// Full world at the start, including the level
+	const std::vector<char>& level() const { return m_level; }
+	uint32_t firstTick() const { return m_index.empty() ? 0 : m_index.front().tick; }
+	uint32_t lastTick() const { return m_index.empty() ? 0 : m_index.back().tick; }
+	/// Tick of the frame currently applied
+	uint32_t tick() const { return m_tick; }
+
+	/// Bring the world to the given tick. Jumps to the closest keyframe when
+	/// going backwards or far forwards, events are only applied when playing.
+	void seek(World& world, uint32_t tick);
+
+	/// Tick of the latest keyframe before / first one after the given tick
+	uint32_t prevKeyframe(uint32_t tick) const;
+	uint32_t nextKeyframe(uint32_t tick) const;
+
+	/// Recorded state hashes, empty unless the world was deterministic
+	const StateHashes& hashes() const { return m_hashes; }
+
+  private:
+	struct Entry {
+		char type;
+		uint32_t tick;
+		size_t offset; ///< Of the payload in m_data
+		size_t size;
+	};
+
+	std::vector<char> m_data;
+	std::vector<char> m_level;
+	std::vector<Entry> m_index;
+	std::vector<size_t> m_keyframes; ///< Positions in m_index
+	size_t m_next; ///< Entry to apply next
+	uint32_t m_tick;
+	std::vector<char> m_frame; ///< Decoded current snapshot
+	StateHashes m_hashes;
+};
+
+/// Play the whole replay into a world fresh from its level, then seek back to
+/// every keyframe and compare the world with how playing left it there.
+/// Returns the keyframe ticks that differ, a seek must not change who is in the world.
+std::vector<uint32_t> checkSeeking(ReplayReader& replay, World& world);
+
+/// First tick at which two runs had different state hashes, 0 if they agree
+/// wherever both have one. The hashes are rolling, so a binary search finds it.
+uint32_t firstDesync(const StateHashes& a, const StateHashes& b);
+
+/// Name for a new replay file in the configured directory
+std::string replayFilename();
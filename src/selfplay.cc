@@ -0,0 +1,128 @@
+#include <map>
+#include <iomanip>
+#include <algorithm>
+#include <boost/bind.hpp>
+
+#include "selfplay.hh"
+#include "world.hh"
+#include "workers.hh"
+#include "texture.hh"
+#include "gamemode.hh"
+#include "replay.hh"
+
+namespace {
+	/// One match on the calling thread, with a clock of its own
+	void playMatch(size_t i, const GameMode& gm, const SelfPlayOptions& opt, std::vector<SelfPlayStats>& results) {
+		SimulatedClock clock;
+		UseClock use(&clock);
+		SelfPlayStats& stats = results[i];
+		TextureMap tm;
+		World world(opt.width, opt.height, tm, gm, true, opt.seeds[i % opt.seeds.size()]);
+		world.setVerbose(false);
+		world.keepEvents(true);
+		world.reseed(i + 1); // Matches on one level differ, but repeat between runs
+		std::vector<Actor*> slots;
+		for (unsigned b = 0; b < opt.bots; ++b) {
+			slots.push_back(world.spawnActor(Actor::AI, (b % 4) + 1));
+		}
+		// Power-up held by actor id, since the last pickup or death
+		const int none = gm.getDefaultPowerup().type == Powerup::NONE ? Powerup::POWERUPS : gm.getDefaultPowerup().type;
+		std::map<uint16_t, int> held;
+		unsigned round_start = 0;
+		while (!world.gameOver() && clock.now < opt.limit) {
+			world.update();
+			GameEvents events = world.takeEvents();
+			for (GameEvents::const_iterator ev = events.begin(); ev != events.end(); ++ev) {
+				switch (ev->type) {
+				case GameEvent::PICKUP:
+					if (ev->value >= 0 && ev->value < Powerup::POWERUPS) {
+						stats.pickups[ev->value]++;
+						held[ev->actor] = ev->value;
+					}
+					break;
+				case GameEvent::KILL:
+					if (ev->other) {
+						std::map<uint16_t, int>::const_iterator it = held.find(ev->other);
+						stats.kills[it == held.end() ? none : it->second]++;
+					} else stats.drowned++;
+					held[ev->actor] = none;
+					break;
+				case GameEvent::ROUND_END:
+					stats.rounds++;
+					stats.round_ticks += world.getTick() - round_start;
+					round_start = world.getTick();
+					break;
+				default:
+					break;
+				}
+			}
+		}
+		stats.matches = 1;
+		stats.unfinished = world.gameOver() ? 0 : 1;
+		stats.ticks = world.getTick();
+		stats.hash = world.getStateHash();
+		for (size_t s = 0; s < slots.size(); ++s) stats.wins[s] = slots[s]->points.wins;
+	}
+}
+
+
+SelfPlayStats::SelfPlayStats(size_t slots): matches(), unfinished(), rounds(), round_ticks(), ticks(), seconds(), drowned(), wins(slots), hash() {
+	std::fill(pickups, pickups + Powerup::POWERUPS, 0);
+	std::fill(kills, kills + Powerup::POWERUPS + 1, 0);
+}
+
+
+void SelfPlayStats::add(const SelfPlayStats& other) {
+	matches += other.matches;
+	unfinished += other.unfinished;
+	rounds += other.rounds;
+	round_ticks += other.round_ticks;
+	ticks += other.ticks;
+	drowned += other.drowned;
+	hash ^= other.hash;
+	if (wins.size() < other.wins.size()) wins.resize(other.wins.size());
+	for (size_t i = 0; i < other.wins.size(); ++i) wins[i] += other.wins[i];
+	for (int i = 0; i < Powerup::POWERUPS; ++i) pickups[i] += other.pickups[i];
+	for (int i = 0; i <= Powerup::POWERUPS; ++i) kills[i] += other.kills[i];
+}
+
+
+void SelfPlayStats::write(std::ostream& os) const {
+	os << std::fixed << std::setprecision(3);
+	os << "[Selfplay]" << std::endl;
+	os << "matches = " << matches << std::endl;
+	os << "unfinished = " << unfinished << std::endl;
+	os << "rounds = " << rounds << std::endl;
+	os << "round_length = " << (rounds ? double(round_ticks) / rounds / REPLAY_TICKRATE : 0.0) << std::endl;
+	os << "drowned = " << drowned << std::endl;
+	os << "ticks = " << ticks << std::endl;
+	os << "ticks_per_second = " << (seconds > 0 ? ticks / seconds : 0.0) << std::endl;
+	os << "hash = " << std::hex << hash << std::dec << std::endl;
+	os << std::endl << "; Share of the finished rounds won, by spawn slot" << std::endl;
+	os << "[Wins]" << std::endl;
+	for (size_t i = 0; i < wins.size(); ++i)
+		os << i + 1 << " = " << (rounds ? double(wins[i]) / rounds : 0.0) << std::endl;
+	// Numbered like the allow list of .gamemode files
+	os << std::endl << "; Pickups, kills made holding it and kills per pickup, by power-up" << std::endl;
+	os << "[Powerups]" << std::endl;
+	for (int i = 0; i < Powerup::POWERUPS; ++i) {
+		os << std::hex << i + 1 << std::dec << " = " << pickups[i] << " " << kills[i] << " "
+		  << (pickups[i] ? double(kills[i]) / pickups[i] : 0.0) << std::endl;
+	}
+	os << "none = 0 " << kills[Powerup::POWERUPS] << std::endl;
+}
+
+
+SelfPlayStats selfPlay(const GameMode& gm, const SelfPlayOptions& options) {
+	SelfPlayOptions opt = options;
+	if (opt.seeds.empty()) opt.seeds.push_back(1);
+	size_t count = opt.seeds.size() * opt.matches;
+	std::vector<SelfPlayStats> results(count, SelfPlayStats(opt.bots));
+	WorkerPool pool(opt.threads);
+	double start = GetPreciseSecs();
+	pool.run(count, boost::bind(&playMatch, _1, boost::cref(gm), boost::cref(opt), boost::ref(results)));
+	SelfPlayStats total(opt.bots);
+	for (size_t i = 0; i < results.size(); ++i) total.add(results[i]);
+	total.seconds = GetPreciseSecs() - start;
+	return total;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <iostream>
+#include <vector>
+#include <stdint.h>
+
+#include "powerups.hh"
+
+class GameMode;
+
+/// What a batch of self-play matches came to
+struct SelfPlayStats {
+	SelfPlayStats(size_t slots = 0);
+	void add(const SelfPlayStats& other);
+	/// Ini-style report
+	void write(std::ostream& os) const;
+
+	unsigned matches;
+	unsigned unfinished;        ///< Stopped at the time limit
+	unsigned rounds;            ///< Finished ones
+	uint64_t round_ticks;       ///< Length of the finished rounds together
+	uint64_t ticks;
+	double seconds;             ///< Wall time
+	unsigned drowned;           ///< Deaths without a killer
+	std::vector<unsigned> wins; ///< Rounds won by spawn slot
+	unsigned pickups[Powerup::POWERUPS];
+	unsigned kills[Powerup::POWERUPS + 1]; ///< By the power-up of the killer, the last one for none
+	uint32_t hash;              ///< Final state hashes XORed, repeats between deterministic runs
+};
+
+struct SelfPlayOptions {
+	SelfPlayOptions(): matches(10), bots(4), threads(0), limit(600), width(25), height(25) { }
+	std::vector<uint32_t> seeds; ///< Levels, every one is played matches times
+	unsigned matches;
+	unsigned bots;
+	unsigned threads;            ///< Besides the calling one, 0 for one less than there are cores
+	float limit;                 ///< Simulated seconds before a match is given up
+	float width, height;         ///< World size
+};
+
+/// Play matches between AI actors in headless worlds, one per core and as
+/// fast as they simulate, for tuning game modes and the AI without playtests
+SelfPlayStats selfPlay(const GameMode& gm, const SelfPlayOptions& options);
@@ -10,9 +10,26 @@ int scrH;
 
 bool config_fullscreen;
 bool config_zoom;
+bool config_netstats;
+bool config_frametimes;
+bool config_deterministic;
 std::string config_default_gamemode;
 int config_default_port;
 std::string config_default_host;
+int config_net_maxclients;
+float config_net_radius;
+int config_net_budget;
+float config_net_statsinterval;
+unsigned config_net_workers;
+float config_net_rewind;
+int config_relay_maxclients;
+float config_relay_delay;
+float config_ai_rate;
+unsigned config_ai_workers;
+bool config_replay_record;
+std::string config_replay_directory;
+float config_replay_keyframe;
+bool config_replay_inputs;
 
 
 void readConfig() {
@@ -25,7 +42,28 @@ void readConfig() {
 
 	config_fullscreen = pt.get("Settings.fullscreen", false);
 	config_zoom = pt.get("Settings.zoom", true);
+	config_netstats = pt.get("Settings.netstats", false);
+	config_frametimes = pt.get("Settings.frametimes", false);
+	config_deterministic = pt.get("Settings.deterministic", false);
 	config_default_gamemode = pt.get("Settings.gamemode", "classic");
 	config_default_host = pt.get("Settings.host", "localhost");
 	config_default_port = pt.get("Settings.port", 1234);
+
+	config_net_maxclients = pt.get("Network.maxclients", 64);
+	config_net_radius = pt.get("Network.radius", 40.0f);
+	config_net_budget = pt.get("Network.budget", 16);
+	config_net_statsinterval = pt.get("Network.statsinterval", 10.0f);
+	config_net_workers = pt.get("Network.workers", 0u);
+	config_net_rewind = pt.get("Network.rewind", 0.2f);
+
+	config_relay_maxclients = pt.get("Relay.maxclients", 256);
+	config_relay_delay = pt.get("Relay.delay", 0.0f);
+
+	config_ai_rate = pt.get("AI.rate", 10.0f);
+	config_ai_workers = pt.get("AI.workers", 0u);
+
+	config_replay_record = pt.get("Replay.record", false);
+	config_replay_directory = pt.get("Replay.directory", "replays");
+	config_replay_keyframe = pt.get("Replay.keyframe", 5.0f);
+	config_replay_inputs = pt.get("Replay.inputs", false);
 }
@@ -7,10 +7,31 @@ extern int scrH;
 
 extern bool config_fullscreen;
 extern bool config_zoom;
+extern bool config_netstats;
+extern bool config_frametimes;
+extern bool config_deterministic;
 
 extern std::string config_default_gamemode;
 
 extern int config_default_port;
 extern std::string config_default_host;
 
+extern int config_net_maxclients;
+extern float config_net_radius;
+extern int config_net_budget;
+extern float config_net_statsinterval;
+extern unsigned config_net_workers;
+extern float config_net_rewind;
+
+extern int config_relay_maxclients;
+extern float config_relay_delay;
+
+extern float config_ai_rate;
+extern unsigned config_ai_workers;
+
+extern bool config_replay_record;
+extern std::string config_replay_directory;
+extern float config_replay_keyframe;
+extern bool config_replay_inputs;
+
 void readConfig();
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <vector>
+#include <stdint.h>
+#include <Box2D.h>
+
+#include "entity.hh"
+#include "netstats.hh"
+
+class Interest;
+
+/// Copy of the dynamic world taken once per tick. Per-client snapshots are
+/// prioritized and encoded from it on worker threads without the World,
+/// reusing the records serialized here for every client.
+struct WorldSnapshot {
+	/// One entity and its ready-made record
+	struct Item {
+		const void* owner; ///< Identity only, never dereferenced
+		b2Vec2 pos;
+		bool idle; ///< Asleep or not moving
+		bool invisible;
+		SerializedEntity record; ///< With the id already filled in
+		Item(): owner(NULL), idle(false), invisible(false), record(0, 0) { }
+	};
+
+	WorldSnapshot(): tick(0) { }
+
+	/// Encode what one client gets to see, returns the size needed even if it didn't fit
+	size_t encode(char* buf, size_t size, const Interest& interest, SnapshotSize* sizes = NULL) const;
+
+	uint32_t tick;
+	std::vector<Item> actors;
+	std::vector<Item> crates;
+	std::vector<char> powerups; ///< Encoded power-up record, the same for everyone
+};
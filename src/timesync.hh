@@ -0,0 +1,97 @@
+#pragma once
+
+#include <deque>
+#include <algorithm>
+#include <stdint.h>
+
+#include "replay.hh"
+
+/// Ping samples kept for the estimate
+#define CLOCK_SAMPLES 32
+
+/// Estimates the offset and drift of a remote clock from ping round trips
+/// and maps the remote's simulation ticks to local time. Times are seconds.
+/// The remote's tick rate is measured from the ticks it reports, tickrate
+/// is only assumed until a few seconds of those have come in.
+struct ClockSync {
+	ClockSync(double tickrate = REPLAY_TICKRATE): offset(0), drift(0), base(0), rtt(0), tickrate(tickrate), ref_tick(0), ref_time(0) { }
+
+	/// Reply to a ping sent at local time sent, received at local time received,
+	/// stamped with the remote clock at the time it was answered
+	void addSample(double sent, double received, double remote) {
+		Sample s;
+		s.local = 0.5 * (sent + received);
+		s.rtt = received - sent;
+		s.offset = remote - s.local;
+		samples.push_back(s);
+		if (samples.size() > CLOCK_SAMPLES) samples.pop_front();
+		fit();
+	}
+
+	/// Where the remote's ticks were at a moment of its clock
+	void setTick(uint32_t tick, double remote) {
+		ref_tick = tick;
+		ref_time = remote;
+		TickSample t = { tick, remote };
+		ticks.push_back(t);
+		if (ticks.size() > CLOCK_SAMPLES) ticks.pop_front();
+		// Ticks over remote seconds, across the window to even out late ticks
+		double span = remote - ticks.front().remote;
+		if (span >= 2.0) tickrate = int32_t(tick - ticks.front().tick) / span;
+	}
+
+	bool synced() const { return !samples.empty(); }
+	double toRemote(double local) const { return local + offset + drift * (local - base); }
+	double toLocal(double remote) const { return (remote - offset + drift * base) / (1.0 + drift); }
+	/// Local time at which the remote simulated the given tick
+	double tickTime(uint32_t tick) const {
+		return toLocal(ref_time + int32_t(tick - ref_tick) / tickrate);
+	}
+	/// Remote tick at a local time, fractional
+	double tickAt(double local) const { return ref_tick + (toRemote(local) - ref_time) * tickrate; }
+
+	double offset;  ///< Remote minus local clock at base
+	double drift;   ///< Seconds gained by the remote clock per local second
+	double base;    ///< Local time the estimate is centered on
+	double rtt;     ///< Best round trip in the window
+	double tickrate; ///< Remote ticks per remote second
+
+  private:
+	struct Sample {
+		double local;  ///< Midpoint of the round trip
+		double rtt;
+		double offset;
+	};
+	struct TickSample {
+		uint32_t tick;
+		double remote;
+	};
+
+	/// Line through the samples with the shortest round trips, those were delayed the least
+	void fit() {
+		rtt = samples.front().rtt;
+		for (size_t i = 0; i < samples.size(); ++i) rtt = std::min(rtt, samples[i].rtt);
+		double limit = rtt * 1.5 + 0.001;
+		double n = 0, sx = 0, sy = 0, sxx = 0, sxy = 0, first = 0, last = 0;
+		for (size_t i = 0; i < samples.size(); ++i) {
+			const Sample& s = samples[i];
+			if (s.rtt > limit) continue;
+			if (n == 0) first = s.local;
+			last = s.local;
+			double x = s.local - samples.front().local; // Keep the sums small
+			n += 1; sx += x; sy += s.offset; sxx += x * x; sxy += x * s.offset;
+		}
+		base = samples.front().local + sx / n;
+		offset = sy / n;
+		// Drift needs a few seconds of samples to mean anything
+		double var = sxx - sx * sx / n;
+		drift = 0;
+		if (n >= 4 && last - first >= 2.0 && var > 0)
+			drift = std::max(-0.001, std::min(0.001, (sxy - sx * sy / n) / var));
+	}
+
+	std::deque<Sample> samples;
+	std::deque<TickSample> ticks;
+	uint32_t ref_tick;
+	double ref_time; ///< Remote clock
+};
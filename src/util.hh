@@ -2,16 +2,45 @@
 
 #include <cstdlib>
 #include <cmath>
+#include <iostream>
 #include <sstream>
 #include <vector>
 #include <stdexcept>
+#include <atomic>
+#include <stdint.h>
 
 #include <GL/gl.h>
 #include <SDL.h>
 
 #define PI 3.1415926535
 
-double inline GetSecs() { return 0.001 * SDL_GetTicks(); }
+/// Time that only moves when told to, e.g. by the simulation ticks.
+/// GetSecs() returns it instead of the wall clock on threads using it.
+struct SimulatedClock {
+	SimulatedClock(double start = 0): now(start) { }
+	void advance(double seconds) { now += seconds; }
+	/// The clock of the calling thread, NULL for wall time
+	static SimulatedClock*& current() { static thread_local SimulatedClock* clock = NULL; return clock; }
+	double now;
+};
+
+/// Makes the calling thread use a simulated clock, or the wall clock for NULL, while it lives
+struct UseClock {
+	UseClock(SimulatedClock* clock): prev(SimulatedClock::current()) { SimulatedClock::current() = clock; }
+	~UseClock() { SimulatedClock::current() = prev; }
+  private:
+	UseClock(const UseClock&);
+	UseClock& operator=(const UseClock&);
+	SimulatedClock* prev;
+};
+
+double inline GetSecs() {
+	if (SimulatedClock* clock = SimulatedClock::current()) return clock->now;
+	return 0.001 * SDL_GetTicks();
+}
+
+/// High resolution time for measuring short intervals
+double inline GetPreciseSecs() { return double(SDL_GetPerformanceCounter()) / SDL_GetPerformanceFrequency(); }
 
 /// Timer
 struct Countdown {
@@ -53,17 +82,75 @@ struct Color {
 template<typename T>
 int inline sign(T num) { return num > 0 ? 1 : (num < 0 ? -1 : 0); }
 
-bool inline randbool() { return rand() % 2 == 0; }
+/// Seeded generator (xoshiro128**) giving the same sequence on every platform,
+/// unlike rand(). Used where both ends must agree, e.g. level generation, and
+/// behind the random helpers below, with a generator of its own for every thread.
+struct Rng {
+	Rng(uint32_t seed = 1) { reseed(seed); }
+	void reseed(uint32_t seed) {
+		// Spread the seed over the state with splitmix32
+		for (int i = 0; i < 4; ++i) {
+			uint32_t z = (seed += 0x9E3779B9u);
+			z = (z ^ (z >> 16)) * 0x85EBCA6Bu;
+			z = (z ^ (z >> 13)) * 0xC2B2AE35u;
+			s[i] = z ^ (z >> 16);
+		}
+	}
+	uint32_t next() {
+		uint32_t result = rotl(s[1] * 5, 7) * 9;
+		uint32_t t = s[1] << 9;
+		s[2] ^= s[0]; s[3] ^= s[1]; s[1] ^= s[2]; s[0] ^= s[3];
+		s[2] ^= t;
+		s[3] = rotl(s[3], 11);
+		return result;
+	}
+	/// Uniform in [0, n) without the bias of next() % n (Lemire's multiply and reject)
+	uint32_t below(uint32_t n) {
+		uint64_t m = uint64_t(next()) * n;
+		if (uint32_t(m) < n) {
+			uint32_t threshold = -n % n;
+			while (uint32_t(m) < threshold) m = uint64_t(next()) * n;
+		}
+		return m >> 32;
+	}
+	int randint(int hi) { return below(hi); }
+	int randint(int lo, int hi) { return below(hi - lo + 1) + lo; }
+	float randf(float lo, float hi) { return (next() >> 8) / 16777216.0f * (hi - lo) + lo; }
+	bool randbool() { return next() >> 31; }
+
+	/// Generator the random helpers below draw from on the calling thread, NULL for its own
+	static Rng*& current() { static thread_local Rng* rng = NULL; return rng; }
+	/// The calling thread's own generator
+	static Rng& local() { static thread_local Rng rng(nextSeed()); return rng; }
+	/// The one the helpers use
+	static Rng& get() { Rng* rng = current(); return rng ? *rng : local(); }
+	/// Seed the calling thread's own generator, those of threads
+	/// drawing their first number after this follow from the same seed
+	static void randomize(uint32_t seed) { seeds() = seed; local().reseed(nextSeed()); }
+  private:
+	static uint32_t rotl(uint32_t x, int k) { return (x << k) | (x >> (32 - k)); }
+	static std::atomic<uint32_t>& seeds() { static std::atomic<uint32_t> seed(1); return seed; }
+	static uint32_t nextSeed() { return seeds().fetch_add(0x9E3779B9u); }
+	uint32_t s[4];
+};
 
-int inline randint(int hi) { return rand() % hi; }
+/// Makes the random helpers of the calling thread use a generator, or the thread's own for NULL, while it lives
+struct UseRng {
+	UseRng(Rng* rng): prev(Rng::current()) { Rng::current() = rng; }
+	~UseRng() { Rng::current() = prev; }
+  private:
+	UseRng(const UseRng&);
+	UseRng& operator=(const UseRng&);
+	Rng* prev;
+};
 
-int inline randint(int lo, int hi) {
-	return (rand() % (hi - lo + 1)) + lo;
-}
+bool inline randbool() { return Rng::get().randbool(); }
 
-float inline randf(float lo, float hi) {
-	return (rand() / float(RAND_MAX) * (hi - lo )) + lo;
-}
+int inline randint(int hi) { return Rng::get().randint(hi); }
+
+int inline randint(int lo, int hi) { return Rng::get().randint(lo, hi); }
+
+float inline randf(float lo, float hi) { return Rng::get().randf(lo, hi); }
 
 void inline swapdir(int& dir) { if (dir == 1) dir = -1; else dir = 1; }
 
@@ -0,0 +1,116 @@
+#pragma once
+
+#include "config.hh"
+
+#include <cstddef>
+#include <algorithm>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#ifdef USE_THREADS
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#endif
+
+/// Fixed set of threads running one job over a range of indices.
+/// run() returns once every index is done, the calling thread helps out.
+class WorkerPool: public boost::noncopyable {
+  public:
+	typedef boost::function<void(size_t)> Job;
+
+	/// Zero threads means one less than there are cores
+	WorkerPool(unsigned threads = 0): m_job(NULL), m_count(0), m_next(0), m_remaining(0), m_generation(0), m_quit(false) {
+		#ifdef USE_THREADS
+		if (threads == 0) threads = std::max(1u, boost::thread::hardware_concurrency()) - 1;
+		for (unsigned i = 0; i < threads; ++i)
+			m_threads.create_thread(boost::bind(&WorkerPool::work, this));
+		#else
+		(void)threads;
+		#endif
+	}
+
+	~WorkerPool() {
+		#ifdef USE_THREADS
+		{
+			boost::mutex::scoped_lock lock(m_mutex);
+			m_quit = true;
+			m_start.notify_all();
+		}
+		m_threads.join_all();
+		#endif
+	}
+
+	/// Number of threads besides the caller
+	size_t size() const {
+		#ifdef USE_THREADS
+		return m_threads.size();
+		#else
+		return 0;
+		#endif
+	}
+
+	/// Call job(i) for every i in [0, count)
+	void run(size_t count, const Job& job) {
+		if (count == 0) return;
+		#ifdef USE_THREADS
+		{
+			boost::mutex::scoped_lock lock(m_mutex);
+			m_job = &job;
+			m_count = count;
+			m_next = 0;
+			m_remaining = count;
+			++m_generation;
+			m_start.notify_all();
+		}
+		help();
+		boost::mutex::scoped_lock lock(m_mutex);
+		while (m_remaining) m_done.wait(lock);
+		m_job = NULL;
+		#else
+		for (size_t i = 0; i < count; ++i) job(i);
+		#endif
+	}
+
+  private:
+	#ifdef USE_THREADS
+	void work() {
+		unsigned seen = 0;
+		while (true) {
+			{
+				boost::mutex::scoped_lock lock(m_mutex);
+				while (!m_quit && (m_generation == seen || !m_job)) m_start.wait(lock);
+				if (m_quit) return;
+				seen = m_generation;
+			}
+			help();
+		}
+	}
+
+	/// Take indices until there are none left
+	void help() {
+		while (true) {
+			const Job* job;
+			size_t i;
+			{
+				boost::mutex::scoped_lock lock(m_mutex);
+				if (!m_job || m_next >= m_count) return;
+				job = m_job;
+				i = m_next++;
+			}
+			(*job)(i);
+			boost::mutex::scoped_lock lock(m_mutex);
+			if (--m_remaining == 0) m_done.notify_all();
+		}
+	}
+
+	boost::mutex m_mutex;
+	boost::condition_variable m_start;
+	boost::condition_variable m_done;
+	boost::thread_group m_threads;
+	#endif
+	const Job* m_job;
+	size_t m_count;
+	size_t m_next;
+	size_t m_remaining;
+	unsigned m_generation;
+	bool m_quit;
+};
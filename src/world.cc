@@ -1,5 +1,6 @@
 #include <algorithm>
 #include <cmath>
+#include <cstring>
 #include <GL/glu.h>
 #include <Box2D.h>
 
@@ -8,11 +9,20 @@
 #include "util.hh"
 #include "texture.hh"
 #include "powerups.hh"
+#include "replay.hh"
+#include "inputlog.hh"
+#include "settings.hh"
+#include "profiler.hh"
+#include "lockstats.hh"
 
 #ifdef USE_THREADS
-	#define LOCKMUTEX boost::mutex::scoped_lock lock(mutex)
+	// Every use is a call site of its own in the lock statistics
+	#define LOCKMUTEX TIMED_LOCK(mutex)
+	// Waits out everyone going through the actors, see Roster
+	#define CHANGEROSTER boost::unique_lock<boost::shared_mutex> roster_lock(roster_mutex)
 #else
 	#define LOCKMUTEX
+	#define CHANGEROSTER
 #endif
 
 namespace {
@@ -20,6 +30,26 @@ namespace {
 	static const unsigned SUPER_MAX_POWERUPS = 5; // Game mode cannot go over this
 	static const float offset = 3.0; // For spawning things away from borders
 
+	/// Selects every entity of a container
+	struct All {
+		bool operator()(size_t) const { return true; }
+		bool hidden(size_t) const { return false; }
+	};
+
+	/// Selects the entities relevant to one client
+	struct RelevantActors {
+		RelevantActors(const Interest& in): in(in) { }
+		bool operator()(size_t i) const { return in.actorRelevant(i); }
+		bool hidden(size_t i) const { return in.actorHidden(i); }
+		const Interest& in;
+	};
+	struct RelevantCrates {
+		RelevantCrates(const Interest& in): in(in) { }
+		bool operator()(size_t i) const { return in.crateRelevant(i); }
+		bool hidden(size_t) const { return false; }
+		const Interest& in;
+	};
+
 	enum ElementType   { NONE, BORDER, WATER, PLATFORM, LADDER, CRATE, BRIDGE, POWERUP, ACTOR, MINE };
 	static ElementType
 	  ElementTypes[] = { NONE, BORDER, WATER, PLATFORM, LADDER, CRATE, BRIDGE, POWERUP, ACTOR, MINE };
@@ -30,9 +60,11 @@ namespace {
 	};
 	// This class captures the closest hit shape.
 	struct RayCastCallback: public b2RayCastCallback {
-		RayCastCallback(): m_fixture(NULL) { }
+		RayCastCallback(bool skip_actors = false): m_fixture(NULL), m_skipActors(skip_actors) { }
 		float32 ReportFixture(b2Fixture* fixture, const b2Vec2& point,
 							  const b2Vec2& normal, float32 fraction) {
+			void* ud = fixture->GetBody()->GetUserData();
+			if (m_skipActors && ud && *(static_cast<ElementType*>(ud)) == ACTOR) return -1; // Ignore
 			m_fixture = fixture;
 			m_point = point;
 			m_normal = normal;
@@ -43,6 +75,7 @@ namespace {
 		b2Vec2 m_point;
 		b2Vec2 m_normal;
 		float32 m_fraction;
+		bool m_skipActors;
 	};
 	// Checks for AABB collisions
 	struct AABBQueryCallback: public b2QueryCallback {
@@ -52,6 +85,163 @@ namespace {
 		b2Fixture* m_fixture;
 	};
 
+	/// Identifies a record in a snapshot: actors by their id, crates by index
+	uint16_t recordId(const Actor& actor, size_t) { return actor.id; }
+	uint16_t recordId(const Crate&, size_t i) { return i; }
+	uint16_t recordId(const WorldSnapshot::Item& item, size_t) { return item.record.id; }
+
+	template <typename T> SerializedEntity record(const T& entity) { return entity.serialize(); }
+	SerializedEntity record(const WorldSnapshot::Item& item) { return item.record; }
+
+	/// What AI perception makes of a body, platforms and borders it knows already
+	unsigned perceive(const b2Body* b) {
+		const void* ud = b->GetUserData();
+		if (!ud) return 0;
+		switch (*static_cast<const ElementType*>(ud)) {
+			case ACTOR: return Perception::ACTORS;
+			case CRATE: return Perception::CRATES;
+			case BRIDGE: return Perception::LEVEL;
+			default: return 0;
+		}
+	}
+
+	/// Headless worlds have no textures
+	GLuint texture(const TextureMap& tm, const std::string& name) {
+		TextureMap::const_iterator it = tm.find(name);
+		return it == tm.end() ? 0 : it->second;
+	}
+
+	/// FNV-1a over the bytes of plain values
+	struct Fnv {
+		Fnv(uint32_t h = 2166136261u): h(h) { }
+		template <typename T> void add(const T& v) {
+			const unsigned char* p = reinterpret_cast<const unsigned char*>(&v);
+			for (size_t i = 0; i < sizeof(T); ++i) h = (h ^ p[i]) * 16777619u;
+		}
+		void add(const b2Vec2& v) { add(v.x); add(v.y); }
+		uint32_t h;
+	};
+
+	bool idle(const b2Body* b) { return !b->IsAwake() || b->GetLinearVelocity().LengthSquared() < 0.0001f; }
+
+	/// Add the bytes of one record to the matching counter
+	void tally(SnapshotSize* sizes, ElementType type, size_t bytes) {
+		if (!sizes) return;
+		switch (type) {
+			case ACTOR: sizes->actors += bytes; break;
+			case CRATE: sizes->crates += bytes; break;
+			case POWERUP: sizes->powerups += bytes; break;
+			default: sizes->statics += bytes; break;
+		}
+	}
+
+	/// Writes snapshot records straight into a caller-provided buffer.
+	/// Keeps counting past the end so that the required size is known.
+	struct SnapshotWriter {
+		SnapshotWriter(char* buf, size_t size, SnapshotSize* sizes = NULL): buf(buf), size(size), pos(0), sizes(sizes) { }
+		void put(char ch) {
+			if (pos < size) buf[pos] = ch;
+			++pos;
+		}
+		/// Variable-length count, 7 bits per byte
+		void putCount(size_t count) {
+			while (count >= 0x80) {
+				put(char((count & 0x7F) | 0x80));
+				count >>= 7;
+			}
+			put(char(count));
+		}
+		void put(const SerializedEntity& se) {
+			if (pos + sizeof(SerializedEntity) <= size) std::memcpy(buf + pos, &se, sizeof(SerializedEntity));
+			pos += sizeof(SerializedEntity);
+		}
+		/// Type, count and the entities of one container
+		template <typename Container> void put(ElementType type, const Container& items) {
+			if (items.empty()) return;
+			size_t start = pos;
+			put(char(type));
+			putCount(items.size());
+			for (typename Container::const_iterator it = items.begin(); it != items.end(); ++it)
+				put(it->serialize());
+			tally(sizes, type, pos - start);
+		}
+		/// Like put(), but only the selected entities, tagged with recordId()
+		template <typename Container, typename Filter>
+		void putIndexed(ElementType type, const Container& items, const Filter& selected) {
+			size_t count = 0;
+			for (size_t i = 0; i < items.size(); ++i) if (selected(i)) ++count;
+			if (count == 0) return;
+			size_t start = pos;
+			put(char(type));
+			putCount(count);
+			for (size_t i = 0; i < items.size(); ++i) {
+				if (!selected(i)) continue;
+				// Hidden ones are a flagged marker
+				SerializedEntity se = selected.hidden(i) ? SerializedEntity(0, 0) : record(items[i]);
+				if (selected.hidden(i)) se.flags = SerializedEntity::HIDDEN;
+				se.id = recordId(items[i], i);
+				put(se);
+			}
+			tally(sizes, type, pos - start);
+		}
+		/// A record encoded earlier
+		void putEncoded(ElementType type, const std::vector<char>& bytes) {
+			if (pos + bytes.size() <= size && !bytes.empty()) std::memcpy(buf + pos, &bytes[0], bytes.size());
+			pos += bytes.size();
+			tally(sizes, type, bytes.size());
+		}
+		char* buf;
+		size_t size;
+		size_t pos;
+		SnapshotSize* sizes;
+	};
+
+	/// Reads snapshot records in place from a received buffer
+	struct SnapshotReader {
+		SnapshotReader(const char* buf, size_t size, SnapshotSize* sizes = NULL):
+		  buf(buf), size(size), pos(0), sizes(sizes) { }
+		/// Consume a record header of the given type, clamping the count to the data available
+		bool header(ElementType type, int& items) {
+			if (pos >= size || buf[pos] != type) return false;
+			size_t start = pos;
+			++pos;
+			size_t count = 0;
+			for (int shift = 0; pos < size && shift < 28; shift += 7) {
+				unsigned char ch = buf[pos++];
+				count |= size_t(ch & 0x7F) << shift;
+				if (!(ch & 0x80)) break;
+			}
+			items = std::min<size_t>(count, (size - pos) / sizeof(SerializedEntity));
+			tally(sizes, type, pos - start + items * sizeof(SerializedEntity));
+			return true;
+		}
+		SerializedEntity peek() const {
+			SerializedEntity se(0, 0);
+			std::memcpy(&se, buf + pos, sizeof(SerializedEntity));
+			return se;
+		}
+		SerializedEntity entity() {
+			SerializedEntity se = peek();
+			pos += sizeof(SerializedEntity);
+			return se;
+		}
+		void skip(int items) { if (items > 0) pos += items * sizeof(SerializedEntity); }
+		/// Largest entity index among the next items records
+		int maxId(int items) const {
+			int id = -1;
+			for (int i = 0; i < items; ++i) {
+				SerializedEntity se(0, 0);
+				std::memcpy(&se, buf + pos + i * sizeof(SerializedEntity), sizeof(SerializedEntity));
+				id = std::max(id, int(se.id));
+			}
+			return id;
+		}
+		const char* buf;
+		size_t size;
+		size_t pos;
+		SnapshotSize* sizes;
+	};
+
 
 	void addScore(Actors& pls, Actor* pl, int score) {
 		if (!pl) return;
@@ -65,24 +255,30 @@ namespace {
 }
 
 
-World::World(int width, int height, TextureMap& tm, GameMode gm, bool master):
-  is_master(master), world(b2Vec2(0.0f, 0.0f)), w(width), h(height),
+World::World(int width, int height, TextureMap& tm, GameMode gm, bool master, uint32_t seed):
+  is_master(master), over(false), verbose(true), keep_events(false), recorder(NULL), input_log(NULL), next_actor_id(1), level_seed(0), tick(0), world(b2Vec2(0.0f, 0.0f)), w(width), h(height),
   SCALE(16.0), view_topleft(0,0), view_bottomright(w,h),
-  tilesize(1), water_height(2.5), timer_powerup(gm.getPowerupDelay()), game(gm)
+  tilesize(1), water_height(2.5), timer_powerup(), game(gm),
+  deterministic(master && config_deterministic), state_hash(0), next_tick(0)
 {
 
 	// Get texture IDs
-	for (int i = 1; i <= 4; ++i) texture_player[i-1] = tm.find(std::string("tomato_") + num2str(i))->second;
-	texture_background = tm.find("background")->second;
-	texture_water = tm.find("water")->second;
-	texture_ground = tm.find("ground")->second;
-	texture_ladder = tm.find("ladder")->second;
-	texture_crate = tm.find("crate")->second;
-	texture_powerups = tm.find("powerups")->second;
+	for (int i = 1; i <= PLAYER_TEXTURES; ++i) texture_player[i-1] = texture(tm, std::string("tomato_") + num2str(i));
+	texture_background = texture(tm, "background");
+	texture_water = texture(tm, "water");
+	texture_ground = texture(tm, "ground");
+	texture_ladder = texture(tm, "ladder");
+	texture_crate = texture(tm, "crate");
+	texture_powerups = texture(tm, "powerups");
 
 	// Generate
 	generateBorders();
-	if (is_master) generateLevel();
+	// Clients generate the level when the server tells the seed
+	if (!seed) seed = Rng::local().next();
+	rng.reseed(seed);
+	Scope scope(*this);
+	if (is_master) generateLevel(seed);
+	timer_powerup = Countdown(game.getPowerupDelay());
 	game.startRound();
 }
 
@@ -93,6 +289,27 @@ Actor* World::shoot(const Actor& shooter) {
 	b2Vec2 point1 = shooter.getBody()->GetWorldCenter() + 1.5 * shooter.getSize() * unitdir;
 	b2Vec2 point2 = shooter.getBody()->GetWorldCenter() + w * unitdir;
 	LOCKMUTEX;
+	// Lag compensation: other actors are where the shooter saw them
+	if (const HistoryFrame* past = historyAt(shooter.view_tick)) {
+		RayCastCallback level(true);
+		world.RayCast(&level, point1, point2);
+		b2RayCastInput input;
+		input.p1 = point1;
+		input.p2 = point2;
+		input.maxFraction = level.m_fixture ? level.m_fraction : 1.0f;
+		Actor* hit = NULL;
+		for (size_t i = 0; i < past->actors.size(); ++i) {
+			Actor* a = findActor(past->actors[i].first);
+			if (!a || a == &shooter) continue;
+			for (b2Fixture* f = a->getBody()->GetFixtureList(); f; f = f->GetNext()) {
+				b2RayCastOutput output;
+				if (!f->GetShape()->RayCast(&output, input, past->actors[i].second, 0)) continue;
+				input.maxFraction = output.fraction;
+				hit = a;
+			}
+		}
+		return hit;
+	}
 	world.RayCast(&callback, point1, point2);
 
 	if (!callback.m_fixture) return NULL;
@@ -114,6 +331,29 @@ Actor* World::shoot(const Actor& shooter) {
 }
 
 
+void World::recordHistory() {
+	// Ticks that fit in the rewind window, plus the current one
+	size_t frames = rewindTicks() + 1;
+	if (frames <= 1) return;
+	if (history.size() != frames) history.assign(frames, HistoryFrame());
+	LOCKMUTEX;
+	HistoryFrame& frame = history[tick % frames];
+	frame.tick = tick;
+	frame.actors.clear();
+	for (Actors::const_iterator it = actors.begin(); it != actors.end(); ++it)
+		frame.actors.push_back(std::make_pair(it->id, it->getBody()->GetTransform()));
+}
+
+
+const World::HistoryFrame* World::historyAt(uint32_t view_tick) const {
+	if (!view_tick || history.empty() || view_tick >= tick) return NULL;
+	// Older than the window: rewind as far as allowed
+	uint32_t t = std::max<uint32_t>(view_tick, tick - (history.size() - 1));
+	const HistoryFrame& frame = history[t % history.size()];
+	return frame.tick == t ? &frame : NULL;
+}
+
+
 void World::kill(Actor* target, Actor* killer) {
 	if (!target) return;
 	target->die();
@@ -134,8 +374,9 @@ void World::kill(Actor* target, Actor* killer) {
 
 	target->respawn = Countdown(game.getRespawnDelay());
 	target->equip(game.getDefaultPowerup());
+	pushEvent(GameEvent(GameEvent::KILL, target->id, killer ? killer->id : 0));
 
-	std::cout << "DEATH! Points: " << target->points.round_score << std::endl;
+	if (verbose) std::cout << "DEATH! Points: " << target->points.round_score << std::endl;
 
 }
 
@@ -163,6 +404,7 @@ b2Vec2 World::randomSpawn() const {
 
 
 b2Vec2 World::randomSpawnLocked() const {
+	Scope scope(*this);
 	LOCKMUTEX;
 	return randomSpawn();
 }
@@ -188,16 +430,74 @@ void World::addMine(float x, float y) {
 }
 
 
-void World::addActor(float x, float y, Actor::Type type, int character, Client* client) {
-	GLuint tex = texture_player[character - 1];
+Actor* World::addActor(float x, float y, Actor::Type type, int character, Client* client, uint16_t id) {
+	GLuint tex = texture_player[(character - 1) % PLAYER_TEXTURES];
 	Actor* actor;
+	Scope scope(*this);
+	CHANGEROSTER;
 	LOCKMUTEX;
 	if (client) actor = new OnlinePlayer(client, tex, type);
 	else actor = new Actor(tex, type);
+	// Bots think on any thread, each with a generator of its own
+	actor->ai.rng.reseed(Rng::get().next());
+	// Ids are never reused, so that they stay valid in events and snapshots
+	if (!id) id = next_actor_id;
+	next_actor_id = std::max<int>(next_actor_id, id + 1);
+	actor->id = id;
 	addActorBody(x, y, actor);
 	actor->world = this;
 	actor->equip(game.getDefaultPowerup());
+	actor->defer_keys = deterministic;
 	actors.push_back(actor);
+	#ifdef USE_THREADS
+	actors_added.notify_all();
+	#endif
+	return actor;
+}
+
+
+Actor* World::spawnActor(Actor::Type type, int character) {
+	b2Vec2 pos = randomSpawnLocked();
+	Actor* actor = addActor(pos.x, pos.y, type, character);
+	if (input_log) input_log->spawn(tick, *actor, character);
+	return actor;
+}
+
+
+void World::removeActor(Actor* actor) {
+	if (input_log) input_log->remove(tick, *actor);
+	CHANGEROSTER;
+	LOCKMUTEX;
+	eraseActor(actor);
+}
+
+
+void World::clearActors() {
+	CHANGEROSTER;
+	LOCKMUTEX;
+	for (Actors::iterator it = actors.begin(); it != actors.end(); ++it) world.DestroyBody(it->getBody());
+	actors.clear();
+	removed_actors.clear();
+}
+
+
+void World::eraseActor(Actor* actor) {
+	for (Actors::iterator it = actors.begin(); it != actors.end(); ++it) {
+		if (&(*it) != actor) continue;
+		world.DestroyBody(it->getBody());
+		removed_actors.insert(it->id);
+		actors.erase(it);
+		return;
+	}
+}
+
+
+void World::waitForActors(size_t count) {
+	#ifdef USE_THREADS
+	// Not LOCKMUTEX, the waiting would count as holding the lock
+	boost::mutex::scoped_lock lock(mutex);
+	while (actors.size() < count) actors_added.wait(lock);
+	#endif
 }
 
 
@@ -418,23 +718,26 @@ void World::generateBorders() {
 }
 
 
-void World::generateLevel() {
+void World::generateLevel(uint32_t seed) {
+	// Everything static comes from the seed so that clients can rebuild it
+	level_seed = seed;
+	Rng rng(seed);
 	float xoff = 1.5*tilesize;
 	float yoff = 2.5*tilesize;
 	// Create starting platforms
-	float x = randf(xoff, xoff+tilesize);
-	float y1 = randf(3*tilesize, 5*tilesize);
-	float y2 = randf(h-8*tilesize, h-5*tilesize);
+	float x = rng.randf(xoff, xoff+tilesize);
+	float y1 = rng.randf(3*tilesize, 5*tilesize);
+	float y2 = rng.randf(h-8*tilesize, h-5*tilesize);
 	int ytilediff = int((y2-y1) / tilesize) + 1;
-	addPlatform(x + tilesize, y1, randint(2,4)); // Top left
-	addPlatform(x, y2, randint(2,4)); // Bottom left
+	addPlatform(x + tilesize, y1, rng.randint(2,4)); // Top left
+	addPlatform(x, y2, rng.randint(2,4)); // Bottom left
 	addLadder(x, y2 - ytilediff * tilesize, ytilediff); // Connect with ladder
 	addLadder(0, y2 - tilesize*0.333f, h - y2); // Left side ladder from water
-	float w1 = randint(2,4);
-	float w2 = randint(2,4);
-	x = randf(w - xoff - tilesize - tilesize, w - xoff - tilesize);
-	y1 = randf(3*tilesize,5*tilesize);
-	y2 = randf(h-8*tilesize,h-5*tilesize);
+	float w1 = rng.randint(2,4);
+	float w2 = rng.randint(2,4);
+	x = rng.randf(w - xoff - tilesize - tilesize, w - xoff - tilesize);
+	y1 = rng.randf(3*tilesize,5*tilesize);
+	y2 = rng.randf(h-8*tilesize,h-5*tilesize);
 	ytilediff = int((y2-y1) / tilesize) + 1;
 	addPlatform(x - w1*tilesize - tilesize, y1, w1); // Top right
 	addPlatform(x - w2*tilesize, y2, w2); // Bottom right
@@ -445,29 +748,69 @@ void World::generateLevel() {
 		int count = 0;
 		for (int i = xoff + 6*tilesize; i < w - xoff - 6*tilesize; i += 7*tilesize) {
 			int tries = 10;
-			while (--tries > 0 && !addPlatform(i + randf(-3*tilesize,3*tilesize), j + randf(-tilesize,tilesize), randint(2,6)));
+			while (--tries > 0 && !addPlatform(i + rng.randf(-3*tilesize,3*tilesize), j + rng.randf(-tilesize,tilesize), rng.randint(2,6)));
 			if (tries > 0) count++;
 		}
 		if (count > 1) {
-			count = randint(count-1);
+			count = rng.randint(count-1);
 			addBridge(platforms.size()-count-2, platforms.size()-count-1);
 		}
 	}
 	//for (int i = 0; i < 4; i++) {
 		//addLadder(randint(0,w), randint(0,h), randint(2,6));
 	//}
-	// Create crates
+	// Create crates, clients get them with the state
+	if (!is_master) return;
+	{
+		LOCKMUTEX;
+		nav.build(platforms, ladders, bridges, h - water_height);
+		perception.build(platforms, w, h);
+	}
 	for (int i = 0; i < 8; i++) {
 		addCrate(randint(0,w), randint(0,h));
 	}
 }
 
 
+void World::clearLevel() {
+	LOCKMUTEX;
+	for (Bridges::iterator it = bridges.begin(); it != bridges.end(); ++it)
+		for (size_t i = 0; i < it->bodies.size(); ++i) world.DestroyBody(it->bodies[i]);
+	for (Platforms::iterator it = platforms.begin(); it != platforms.end(); ++it) world.DestroyBody(it->getBody());
+	for (Ladders::iterator it = ladders.begin(); it != ladders.end(); ++it) world.DestroyBody(it->getBody());
+	bridges.clear();
+	platforms.clear();
+	ladders.clear();
+	nav.clear();
+	perception.clear();
+}
+
+
+uint32_t World::levelHash() const {
+	// FNV-1a of the static records as they would be sent
+	std::vector<char> buf;
+	size_t size = 0;
+	do {
+		buf.resize(size);
+		SnapshotWriter data(buf.empty() ? NULL : &buf[0], buf.size());
+		LOCKMUTEX;
+		data.put(PLATFORM, platforms);
+		data.put(LADDER, ladders);
+		data.put(BRIDGE, bridges);
+		size = data.pos;
+	} while (size > buf.size());
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < size; ++i) hash = (hash ^ uint8_t(buf[i])) * 16777619u;
+	return hash;
+}
+
+
 void World::newRound() {
 	// TODO: Proper game ending
 	if (game.gameEnded()) {
-		std::cout << "Game ended." << std::endl;
-		exit(0);
+		if (verbose) std::cout << "Game ended." << std::endl;
+		over = true;
+		return;
 	}
 	// TODO: Show previous round winner etc.
 
@@ -484,7 +827,7 @@ void World::newRound() {
 		world = b2World(b2Vec2(), true);
 	}
 	generateBorders();
-	generateLevel();
+	generateLevel(rand());
 	*/
 	{ 	LOCKMUTEX;
 		for (Actors::iterator it = actors.begin(); it != actors.end(); ++it) {
@@ -498,17 +841,145 @@ void World::newRound() {
 }
 
 
+void World::think(bool headless) {
+	if (!is_master) return;
+	PROFILE("think");
+	// Each actor thinks every period ticks, offset by id so that they take turns
+	unsigned period = std::max(1, int(1.0 / (tickPeriod() * std::max(config_ai_rate, 1.0f)) + 0.5));
+	thinkers.clear();
+	{
+		LOCKMUTEX;
+		for (Actors::iterator it = actors.begin(); it != actors.end(); ++it)
+			if (it->type == Actor::AI && (tick + it->id) % period == 0) thinkers.push_back(&(*it));
+		if (thinkers.empty()) return;
+		ai_view.actors.clear();
+		for (Actors::const_iterator it = actors.begin(); it != actors.end(); ++it) {
+			AIView::Body b;
+			b.actor = &(*it);
+			b.id = it->id;
+			b.body = it->getBody();
+			b.pos = it->getBody()->GetPosition();
+			b.dead = it->is_dead();
+			b.invisible = it->invisible;
+			b.airborne = it->airborne;
+			b.on_ladder = it->ladder != Actor::LADDER_NO;
+			b.dir = it->dir;
+			b.jumping = it->jumping;
+			b.powerup = it->powerup.type;
+			ai_view.actors.push_back(b);
+		}
+		ai_view.reindex();
+		ai_view.powerups.clear();
+		for (Powerups::const_iterator it = powerups.begin(); it != powerups.end(); ++it)
+			ai_view.powerups.push_back(it->getBody()->GetPosition());
+		// All their questions at once, only moving things need the lock
+		perception.reset();
+		for (size_t i = 0; i < thinkers.size(); ++i)
+			thinkers[i]->sense(ai_view, *ai_view.find(thinkers[i]->id), perception);
+		perception.queryDynamic(world, perceive);
+	}
+	perception.queryStatic();
+	// Headless worlds run one per core already
+	if (headless) {
+		for (size_t i = 0; i < thinkers.size(); ++i) thinkJob(i);
+		return;
+	}
+	// Nothing reads ai_view or the thinkers' AI state while the workers run.
+	// The tick still waits for them: this takes thinking out of the world
+	// lock and spreads it over the cores, it doesn't take it off the tick.
+	if (!ai_workers) ai_workers.reset(new WorkerPool(config_ai_workers));
+	ai_workers->run(thinkers.size(), boost::bind(&World::thinkJob, this, _1));
+}
+
+
+void World::thinkJob(size_t i) {
+	PROFILE("think job");
+	// Workers are on the wall clock unless the world counts ticks
+	UseClock use_clock(deterministic ? &sim_clock : SimulatedClock::current());
+	UseRng use_rng(&thinkers[i]->ai.rng);
+	thinkers[i]->think(ai_view, nav, perception);
+}
+
+
+void World::hashState() {
+	PROFILE("hash");
+	// Continues from the previous tick's hash, so that once two runs part
+	// they differ in every later tick and the first such one can be bisected
+	Fnv hash(state_hash);
+	hash.add(tick);
+	LOCKMUTEX;
+	for (Actors::const_iterator it = actors.begin(); it != actors.end(); ++it) {
+		const b2Body* b = it->getBody();
+		hash.add(it->id);
+		hash.add(b->GetPosition());
+		hash.add(b->GetAngle());
+		hash.add(b->GetLinearVelocity());
+		hash.add(it->is_dead());
+		hash.add(it->powerup.type);
+		hash.add(it->points.total_score);
+	}
+	for (Crates::const_iterator it = crates.begin(); it != crates.end(); ++it) {
+		const b2Body* b = it->getBody();
+		hash.add(b->GetPosition());
+		hash.add(b->GetAngle());
+		hash.add(b->GetLinearVelocity());
+	}
+	for (Powerups::const_iterator it = powerups.begin(); it != powerups.end(); ++it) {
+		hash.add(it->getBody()->GetPosition());
+		hash.add(it->effect.type);
+	}
+	state_hash = hash.h;
+}
+
+
+void World::awardRound() {
+	// A win for the best round score, none on a tie
+	LOCKMUTEX;
+	Actor* best = NULL;
+	bool tie = false;
+	for (Actors::iterator it = actors.begin(); it != actors.end(); ++it) {
+		if (best && it->points.round_score == best->points.round_score) tie = true;
+		else if (!best || it->points.round_score > best->points.round_score) { best = &(*it); tie = false; }
+	}
+	if (best && !tie) best->points.wins++;
+}
+
+
 void World::update() {
 	// Prepare for simulation. Typically we use a time step of 1/60 of a
 	// second (60Hz) and 10 iterations. This provides a high quality simulation
 	// in most game scenarios.
-	float32 timeStep = 1.0f / 100.0f;
+	float32 timeStep = tickPeriod();
 	int32 velocityIterations = 10;
 	int32 positionIterations = 10;
 
-	double t = GetSecs();
+	if (over) return;
+	// Headless runs bring their own clock, Scope may replace it for this tick
+	SimulatedClock* headless = SimulatedClock::current();
+	#ifdef USE_THREADS
+	// Start ticks every timeStep on the wall clock, catching up after short stalls
+	if (!headless) {
+		double now = GetPreciseSecs();
+		if (now - next_tick > 0.1) next_tick = now;
+		else if (next_tick > now) boost::this_thread::sleep(boost::posix_time::microseconds(int64_t((next_tick - now) * 1e6)));
+		next_tick += timeStep;
+	}
+	#endif
+	PROFILE("update");
+	Scope scope(*this);
+	Roster roster(*this);
+	// Local players press keys at tick boundaries only
+	if (deterministic) {
+		for (Actors::iterator it = actors.begin(); it != actors.end(); ++it) {
+			if (it->type != Actor::HUMAN) continue;
+			InputFrame f = it->takeKeys();
+			if (!it->is_dead() && !f.empty()) input(&(*it), f);
+		}
+	}
+	think(headless != NULL);
 	{
 		LOCKMUTEX;
+		PROFILE_SECTION("step");
 
 		// Instruct the world to perform a single step of simulation.
 		// It is generally best to keep the time step and iterations fixed.
@@ -518,6 +989,7 @@ void World::update() {
 		// should know about this function.
 		world.ClearForces();
 
+		PROFILE_NEXT("actors");
 		// Update actors' airborne etc. status + gravity
 		int alive_people = 0;
 		for (Actors::iterator it = actors.begin(); it != actors.end(); ++it) {
@@ -559,6 +1031,7 @@ void World::update() {
 					for (Powerups::iterator pu = powerups.begin(); pu != powerups.end(); ++pu) {
 						if (!pu->getBody()->GetUserData()) {
 							it->equip(pu->effect);
+							pushEvent(GameEvent(GameEvent::PICKUP, it->id, 0, pu->effect.type));
 							world.DestroyBody(ce->other);
 							powerups.erase(pu);
 							break;
@@ -602,9 +1075,10 @@ void World::update() {
 			float grav_mult = (it->lograv ? 0.1 : 1.0) * (it->ladder == Actor::LADDER_CLIMBING ? 0.0 : 1.0);
 			b->ApplyForceToCenter(b2Vec2(0, b->GetMass() * GRAVITY * grav_mult), true);
 			// AI
-			if (it->type == Actor::AI) it->brains();
+			if (it->type == Actor::AI) it->handle_ai();
 		} //< End of Actors loop
 		if (alive_people <= 1) game.noOpponentsLeft();
+		PROFILE_NEXT("crates");
 		// Crates
 		for (Crates::iterator it = crates.begin(); it != crates.end(); ++it) {
 			b2Body* b = it->getBody();
@@ -624,6 +1098,7 @@ void World::update() {
 			// Gravity
 			b->ApplyForceToCenter(b2Vec2(0, b->GetMass() * GRAVITY), true);
 		}
+		PROFILE_NEXT("powerups");
 		// Remove expired power-ups
 		for (Powerups::iterator pu = powerups.begin(); pu != powerups.end(); ) {
 			if (pu->expired()) {
@@ -634,129 +1109,137 @@ void World::update() {
 			++pu;
 		}
 	} //< Mutex
+	// Power-ups lock the world themselves
+	for (Actors::iterator it = actors.begin(); it != actors.end(); ++it) {
+		if (!it->ai.action) continue;
+		it->ai.action = false;
+		if (!it->is_dead()) it->action();
+	}
 	// Create power-ups
 	if (timer_powerup() && is_master) {
 		addPowerup(randf(offset, w-offset), randf(offset, h-offset), game.randPowerup());
 		timer_powerup = Countdown(game.getPowerupDelay());
 	}
-	if (game.roundEnded()) newRound();
-	#ifdef USE_THREADS
-	// TODO: Hackish
-	t = GetSecs() - t;
-	int tt = (timeStep - t - 0.001) * 0.5 * 1000;
-	if (tt > 0) boost::this_thread::sleep(boost::posix_time::milliseconds(tt));
-	#endif
+	if (game.roundEnded()) {
+		awardRound();
+		pushEvent(GameEvent(GameEvent::ROUND_END, 0, 0, game.roundsLeft()));
+		newRound();
+	}
+	++tick;
+	// Same length as the wall clock ticks, so timers last as long in both modes
+	sim_clock.now = tick * tickPeriod();
+	if (is_master) {
+		recordHistory();
+		hashState();
+	}
+	if (recorder) recorder->frame(*this);
+	// Simulated time goes as fast as the simulation
+	if (headless) headless->advance(timeStep);
 }
 
 
-std::string World::serialize(bool skip_static) const {
+size_t World::serialize(char* buf, size_t size, bool skip_static) const {
+	PROFILE("serialize");
+	SnapshotWriter data(buf, size);
 	LOCKMUTEX;
-	std::string data = "";
-	// Players
-	if (!actors.empty()) {
-		data += std::string(1, ACTOR);
-		data += std::string(1, (char)actors.size());
-		for (Actors::const_iterator it = actors.begin(); it != actors.end(); ++it) {
-			std::string temp(it->serialize(), sizeof(SerializedEntity));
-			data += temp;
-		}
+	data.putIndexed(ACTOR, actors, All());
+	data.putIndexed(CRATE, crates, All());
+	data.put(POWERUP, powerups);
+	// Static objects
+	if (!skip_static) {
+		data.put(PLATFORM, platforms);
+		data.put(LADDER, ladders);
+		data.put(BRIDGE, bridges);
 	}
-	// Crates
-	if (!crates.empty()) {
-		data += std::string(1, CRATE);
-		data += std::string(1, (char)crates.size());
-		for (Crates::const_iterator it = crates.begin(); it != crates.end(); ++it) {
-			std::string temp(it->serialize(), sizeof(SerializedEntity));
-			data += temp;
-		}
+	return data.pos;
+}
+
+
+void World::capture(WorldSnapshot& snapshot) const {
+	PROFILE("capture");
+	LOCKMUTEX;
+	snapshot.tick = tick;
+	snapshot.actors.resize(actors.size());
+	for (size_t i = 0; i < actors.size(); ++i) {
+		const Actor& a = actors[i];
+		WorldSnapshot::Item& item = snapshot.actors[i];
+		item.owner = &a;
+		item.pos = a.getBody()->GetWorldCenter();
+		item.idle = idle(a.getBody());
+		item.invisible = a.invisible;
+		item.record = a.serialize();
+		item.record.id = a.id;
 	}
-	// Power-ups
-	if (!powerups.empty()) {
-		data += std::string(1, POWERUP);
-		data += std::string(1, (char)powerups.size());
-		for (Powerups::const_iterator it = powerups.begin(); it != powerups.end(); ++it) {
-			std::string temp(it->serialize(), sizeof(SerializedEntity));
-			data += temp;
-		}
+	snapshot.crates.resize(crates.size());
+	for (size_t i = 0; i < crates.size(); ++i) {
+		WorldSnapshot::Item& item = snapshot.crates[i];
+		item.owner = &crates[i];
+		item.pos = crates[i].getBody()->GetWorldCenter();
+		item.idle = idle(crates[i].getBody());
+		item.record = crates[i].serialize();
+		item.record.id = i;
 	}
-	// Static objects
-	if (!skip_static) {
-		// Platforms
-		if (!platforms.empty()) {
-			data += std::string(1, PLATFORM);
-			data += std::string(1, (char)platforms.size());
-			for (Platforms::const_iterator it = platforms.begin(); it != platforms.end(); ++it) {
-				std::string temp(it->serialize(), sizeof(SerializedEntity));
-				data += temp;
-			}
-		}
-		// Ladders
-		if (!ladders.empty()) {
-			data += std::string(1, LADDER);
-			data += std::string(1, (char)ladders.size());
-			for (Ladders::const_iterator it = ladders.begin(); it != ladders.end(); ++it) {
-				std::string temp(it->serialize(), sizeof(SerializedEntity));
-				data += temp;
-			}
-		}
-		// Bridges
-		if (!bridges.empty()) {
-			data += std::string(1, BRIDGE);
-			data += std::string(1, (char)bridges.size());
-			for (Bridges::const_iterator it = bridges.begin(); it != bridges.end(); ++it) {
-				std::string temp(it->serialize(), sizeof(SerializedEntity));
-				data += temp;
-			}
-		}
+	// Power-ups aren't filtered, so their record is the same for every client
+	std::vector<char>& out = snapshot.powerups;
+	while (true) {
+		SnapshotWriter data(out.empty() ? NULL : &out[0], out.size());
+		data.put(POWERUP, powerups);
+		bool fits = data.pos <= out.size();
+		out.resize(data.pos);
+		if (fits) break;
 	}
-	return data;
 }
 
 
-void World::update(std::string data, Client* client) {
-	int pos = 0;
-	if (data[pos] == ACTOR) {
-		int items = data[pos+1];
-		int cnt = 0; pos += 2;
-		// New players?
-		int oldplayers = actors.size();
-		int createnew = items - oldplayers;
-		if (createnew > 0) {
-			for (int i = 0; i < createnew; ++i) {
-				bool me = client && oldplayers + i + 1 == client->getID();
-				addActor(10, 10, me ? Actor::HUMAN : Actor::REMOTE, oldplayers+i+1, me ? client : NULL);
-			}
+size_t WorldSnapshot::encode(char* buf, size_t size, const Interest& interest, SnapshotSize* sizes) const {
+	SnapshotWriter data(buf, size, sizes);
+	data.putIndexed(ACTOR, actors, RelevantActors(interest));
+	data.putIndexed(CRATE, crates, RelevantCrates(interest));
+	data.putEncoded(POWERUP, powerups);
+	return data.pos;
+}
+
+
+void World::update(const char* buf, size_t size, Client* client, SnapshotSize* sizes) {
+	PROFILE("decode");
+	SnapshotReader data(buf, size, sizes);
+	int items = 0;
+	if (data.header(ACTOR, items)) {
+		// Records are tagged with actor ids, create the ones not seen before
+		size_t start = data.pos;
+		for (int i = 0; i < items; ++i) {
+			SerializedEntity se = data.entity();
+			if (findActor(se.id) || removed_actors.count(se.id)) continue;
+			bool me = client && se.id == client->getID();
+			addActor(10, 10, me ? Actor::HUMAN : Actor::REMOTE, se.id, me ? client : NULL, se.id);
 		}
+		data.pos = start;
 		LOCKMUTEX;
 		// Update
-		for (Actors::iterator it = actors.begin(); it != actors.end() && cnt < items; ++it, ++cnt, pos += sizeof(SerializedEntity)) {
-			std::string itemdata(&data[pos], sizeof(SerializedEntity));
-			it->unserialize(itemdata);
+		for (int i = 0; i < items; ++i) {
+			SerializedEntity se = data.entity();
+			if (Actor* actor = findActor(se.id)) actor->unserialize(se);
 		}
 	}
-	if (data[pos] == CRATE) {
-		int items = data[pos+1];
-		int cnt = 0; pos += 2;
+	if (data.header(CRATE, items)) {
 		// Check if we need to create new ones
-		int createnew = items - crates.size();
+		int createnew = data.maxId(items) + 1 - crates.size();
 		if (createnew > 0) {
 			for (int i = 0; i < createnew; ++i) addCrate(randint(0,w), randint(0,h));
 		}
 		LOCKMUTEX;
 		// Update position etc.
-		for (Crates::iterator it = crates.begin(); it != crates.end() && cnt < items; ++it, ++cnt, pos += sizeof(SerializedEntity)) {
-			std::string itemdata(&data[pos], sizeof(SerializedEntity));
-			it->unserialize(itemdata);
+		for (int i = 0; i < items; ++i) {
+			SerializedEntity se = data.entity();
+			crates[se.id].unserialize(se);
 		}
 	}
-	if (data[pos] == POWERUP) {
-		int items = data[pos+1];
-		int cnt = 0; pos += 2;
+	if (data.header(POWERUP, items)) {
 		// Check if we need to crete a delete power-ups
 		int createnew = items - powerups.size();
 		if (createnew > 0) { // Create new ones
 			for (int i = 0; i < createnew; ++i) addPowerup(randint(0,w), randint(0,h),
-			  Powerup::PowerupTypes[(int)data[sizeof(SerializedEntity)-2]]);
+			  Powerup::PowerupTypes[(int)data.peek().type]);
 		} else if (createnew < 0) { // Delete old ones
 			LOCKMUTEX;
 			for (int i = 0; i < -createnew; ++i) {
@@ -767,43 +1250,97 @@ void World::update(std::string data, Client* client) {
 		}
 		LOCKMUTEX;
 		// Update position etc.
-		for (Powerups::iterator it = powerups.begin(); it != powerups.end() && cnt < items; ++it, ++cnt, pos += sizeof(SerializedEntity)) {
-			std::string itemdata(&data[pos], sizeof(SerializedEntity));
-			it->unserialize(itemdata);
-		}
+		int cnt = 0;
+		for (Powerups::iterator it = powerups.begin(); it != powerups.end() && cnt < items; ++it, ++cnt)
+			it->unserialize(data.entity());
+		data.skip(items - cnt);
 	}
 	// Static objects (platforms, ladders...)
 	// For now, these are always interpreted as new ones
-	if (data[pos] == PLATFORM) {
-		int items = data[pos+1];
-		pos += 2;
+	if (data.header(PLATFORM, items)) {
 		// Create new
-		for (int i = 0; i < items; ++i, pos += sizeof(SerializedEntity)) {
-			SerializedEntity* se = reinterpret_cast<SerializedEntity*>(&data[pos]);
-			addPlatform(se->x - se->vx / 2 * tilesize, se->y - tilesize*0.5f, se->vx, true);
+		for (int i = 0; i < items; ++i) {
+			SerializedEntity se = data.entity();
+			addPlatform(se.x - se.vx / 2 * tilesize, se.y - tilesize*0.5f, se.vx, true);
 		}
 	}
-	if (data[pos] == LADDER) {
-		int items = data[pos+1];
-		pos += 2;
+	if (data.header(LADDER, items)) {
 		// Create new
-		for (int i = 0; i < items; ++i, pos += sizeof(SerializedEntity)) {
-			SerializedEntity* se = reinterpret_cast<SerializedEntity*>(&data[pos]);
-			addLadder(se->x - tilesize*0.5f, se->y - se->vy / 2 * tilesize, se->vy);
+		for (int i = 0; i < items; ++i) {
+			SerializedEntity se = data.entity();
+			addLadder(se.x - tilesize*0.5f, se.y - se.vy / 2 * tilesize, se.vy);
 		}
 	}
-	if (data[pos] == BRIDGE) {
-		int items = data[pos+1];
-		pos += 2;
+	if (data.header(BRIDGE, items)) {
 		// Create new
-		for (int i = 0; i < items; ++i, pos += sizeof(SerializedEntity)) {
-			SerializedEntity* se = reinterpret_cast<SerializedEntity*>(&data[pos]);
-			addBridge(se->id, se->type);
+		for (int i = 0; i < items; ++i) {
+			SerializedEntity se = data.entity();
+			addBridge(se.id, se.type);
 		}
 	}
 }
 
 
+Actor* World::findActor(uint16_t id) {
+	for (Actors::iterator it = actors.begin(); it != actors.end(); ++it)
+		if (it->id == id) return &(*it);
+	return NULL;
+}
+
+
+void World::input(Actor* actor, const InputFrame& f, uint32_t view_tick) {
+	PROFILE("input");
+	Scope scope(*this);
+	if (input_log) input_log->input(tick, *actor, f, view_tick);
+	actor->view_tick = view_tick;
+	actor->applyInput(f);
+	actor->view_tick = 0;
+}
+
+
+void World::pushEvent(const GameEvent& ev) {
+	if (!is_master) return; // Clients get these from the server
+	if (recorder) recorder->event(ev);
+	if (!keep_events) return;
+	#ifdef USE_THREADS
+	boost::mutex::scoped_lock lock(event_mutex);
+	#endif
+	events.push_back(ev);
+}
+
+
+GameEvents World::takeEvents() {
+	GameEvents ret;
+	#ifdef USE_THREADS
+	boost::mutex::scoped_lock lock(event_mutex);
+	#endif
+	ret.swap(events);
+	return ret;
+}
+
+
+void World::applyEvent(const GameEvent& ev) {
+	// Leaving frees the actor, which the input and render threads may be going through
+	CHANGEROSTER;
+	LOCKMUTEX;
+	Actor* actor = findActor(ev.actor);
+	Actor* other = findActor(ev.other);
+	std::string name = actor ? actor->getName() : "Someone";
+	switch (ev.type) {
+	case GameEvent::JOIN: std::cout << name << " joined." << std::endl; break;
+	case GameEvent::LEAVE:
+		std::cout << name << " left." << std::endl;
+		if (actor) eraseActor(actor);
+		break;
+	case GameEvent::KILL:
+		std::cout << name << (other ? " was killed by " + other->getName() : " died") << "." << std::endl;
+		break;
+	case GameEvent::PICKUP: std::cout << name << " picked up power-up " << ev.value << "." << std::endl; break;
+	case GameEvent::ROUND_END: std::cout << "Round ended, " << ev.value << " left." << std::endl; break;
+	}
+}
+
+
 void World::updateViewport() {
 	// Magick zooming camera variables
 	static const float xmargin = 8.0;
@@ -860,6 +1397,7 @@ void World::updateViewport() {
 
 
 void World::draw() const {
+	PROFILE("draw");
 	{ // Magic zooming viewport
 		LOCKMUTEX;
 		glMatrixMode(GL_PROJECTION);
@@ -3,14 +3,19 @@
 #include "config.hh"
 #ifdef USE_THREADS
 #include <boost/thread/mutex.hpp>
+#include <boost/thread/shared_mutex.hpp>
 #include <boost/thread/thread.hpp>
+#include <boost/thread/condition_variable.hpp>
 #include <boost/bind.hpp>
+#include <boost/scoped_ptr.hpp>
 #endif
 
 #include <iostream>
 #include <string>
 #include <vector>
 #include <map>
+#include <set>
+#include <algorithm>
 #include <GL/gl.h>
 #include <Box2D.h>
 
@@ -20,14 +25,57 @@
 #include "player.hh"
 #include "worldelements.hh"
 #include "gamemode.hh"
+#include "interest.hh"
+#include "snapshot.hh"
+#include "events.hh"
+#include "netstats.hh"
+#include "nav.hh"
+#include "perception.hh"
+#include "workers.hh"
+#include "replay.hh"
+#include "settings.hh"
 
 #define GRAVITY 2.5f
+#define PLAYER_TEXTURES 4
+/// Bump whenever generateLevel creates a different level from the same seed
+#define LEVEL_VERSION 2
 
 class Client;
+class ReplayWriter;
+class InputLogWriter;
 
 class World {
   public:
-	World(int width, int height, TextureMap& tm, GameMode gm, bool master = true);
+	/// Puts the calling thread on the world's tick clock and random generator
+	/// while it lives, if the world is deterministic. For code that changes the
+	/// world outside update(), e.g. applying network input.
+	class Scope {
+	  public:
+		Scope(const World& world):
+		  clock(world.deterministic ? &world.sim_clock : SimulatedClock::current()),
+		  rng(world.deterministic ? &world.rng : Rng::current()) { }
+	  private:
+		UseClock clock;
+		UseRng rng;
+	};
+
+	/// Keeps actors from being added or removed while it lives, for going
+	/// through them outside the world lock. Take it before the world lock.
+	class Roster {
+	  public:
+		Roster(const World& world)
+		#ifdef USE_THREADS
+		  : lock(world.roster_mutex)
+		#endif
+		  { }
+	  private:
+		#ifdef USE_THREADS
+		boost::shared_lock<boost::shared_mutex> lock;
+		#endif
+	};
+
+	/// Seed 0 picks a random level
+	World(int width, int height, TextureMap& tm, GameMode gm, bool master = true, uint32_t seed = 0);
 
 	Actor* shoot(const Actor& shooter);
 	void kill(Actor* target, Actor* killer = NULL);
@@ -36,7 +84,13 @@ class World {
 	b2Vec2 randomSpawnLocked() const;
 
 	void addMine(float x, float y);
-	void addActor(float x, float y, Actor::Type type, int character = 1, Client* client = NULL);
+	Actor* addActor(float x, float y, Actor::Type type, int character = 1, Client* client = NULL, uint16_t id = 0);
+	/// Add an actor at a random spawn point, the way the master brings in players
+	Actor* spawnActor(Actor::Type type, int character = 1);
+	void removeActor(Actor* actor);
+	/// Remove every actor and forget the removed ones, before a snapshot
+	/// that should be the whole truth about who is in the world
+	void clearActors();
 	void addActorBody(float x, float y, Actor* actor);
 	bool addPlatform(float x, float y, float w, bool force = false);
 	void addLadder(float x, float y, float h);
@@ -45,23 +99,88 @@ class World {
 	void addPowerup(float x, float y, Powerup::Type type);
 
 	void generateBorders();
-	void generateLevel();
+	void generateLevel(uint32_t seed);
+	void clearLevel();
+	uint32_t getLevelSeed() const { return level_seed; }
+	uint32_t levelHash() const;
 	void newRound();
+	void waitForActors(size_t count);
 
-	std::string serialize(bool skip_static = true) const;
+	size_t serialize(char* buf, size_t size, bool skip_static = true) const;
+	void capture(WorldSnapshot& snapshot) const;
 	void update();
-	void update(std::string data, Client* client = NULL);
+	void update(const char* data, size_t size, Client* client = NULL, SnapshotSize* sizes = NULL);
+	void applyEvent(const GameEvent& ev);
+	/// Apply a player's input at this tick boundary, view_tick as in Actor
+	void input(Actor* actor, const InputFrame& f, uint32_t view_tick = 0);
+	void pushEvent(const GameEvent& ev);
+	/// Queue events for takeEvents, off unless something drains the queue
+	void keepEvents(bool keep) { keep_events = keep; }
+	GameEvents takeEvents();
 	void updateViewport();
 	void draw() const;
 
+	unsigned getTick() const { return tick; }
+	/// Seconds per tick, simulated and on the wall clock alike
+	static double tickPeriod() { return 1.0 / REPLAY_TICKRATE; }
+	/// How many ticks back shots may be resolved, from the rewind setting
+	static unsigned rewindTicks() { return std::max(0, int(config_net_rewind / tickPeriod() + 0.5)); }
+	float getWidth() const { return w; }
+	float getHeight() const { return h; }
+	/// All rounds played, update() does nothing more
+	bool gameOver() const { return over; }
+	/// Seeded randomness, timers counted in ticks and local input applied by update()
+	bool isDeterministic() const { return deterministic; }
+	/// Hash of the dynamic state after the latest tick, rolled over all earlier ones
+	uint32_t getStateHash() const { return state_hash; }
+	/// Restart the random sequence of a deterministic world
+	void reseed(uint32_t seed) { rng.reseed(seed); }
 	b2World& getWorld() { return world; }
+	void setRecorder(ReplayWriter* rec) { recorder = rec; }
+	void setInputLog(InputLogWriter* log) { input_log = log; }
+	/// Whether to print deaths and the end of the game
+	void setVerbose(bool v) { verbose = v; }
 	Actors& getActors() { return actors; }
+	const Actors& getActors() const { return actors; }
+	const Powerups& getPowerups() const { return powerups; }
+	const NavGraph& getNav() const { return nav; }
 
   private:
+	/// Actor positions after one tick, to rewind shots to what a client saw
+	struct HistoryFrame {
+		HistoryFrame(): tick(0) { }
+		uint32_t tick;
+		std::vector<std::pair<uint16_t, b2Transform> > actors; ///< By actor id
+	};
+
+	Actor* findActor(uint16_t id);
+	void eraseActor(Actor* actor);
+	void recordHistory();
+	void awardRound();
+	void hashState();
+	/// Let the AI actors whose turn it is decide on their keys,
+	/// on this thread only when headless
+	void think(bool headless);
+	void thinkJob(size_t i);
+	const HistoryFrame* historyAt(uint32_t view_tick) const;
+
 	#ifdef USE_THREADS
 	mutable boost::mutex mutex;
+	boost::mutex event_mutex;
+	boost::condition_variable actors_added;
+	mutable boost::shared_mutex roster_mutex; ///< See Roster
 	#endif
 	bool is_master;
+	bool over;
+	bool verbose;
+	bool keep_events;
+	ReplayWriter* recorder; ///< Gets every tick and event if set
+	InputLogWriter* input_log; ///< Gets spawns, removals and input if set
+	uint16_t next_actor_id;
+	std::set<uint16_t> removed_actors; ///< Never to be recreated by a late state
+	uint32_t level_seed;
+	unsigned tick;
+	std::vector<HistoryFrame> history; ///< Ring indexed by tick, config_net_rewind long
 	b2World world;
 	float w;
 	float h;
@@ -70,7 +189,7 @@ class World {
 	b2Vec2 view_bottomright;
 	float tilesize;
 	float water_height;
-	GLuint texture_player[4];
+	GLuint texture_player[PLAYER_TEXTURES];
 	GLuint texture_background;
 	GLuint texture_water;
 	GLuint texture_ground;
@@ -83,6 +202,17 @@ class World {
 	Crates crates;
 	Bridges bridges;
 	Powerups powerups;
+	NavGraph nav; ///< For AI actors, only built on the master
+	boost::scoped_ptr<WorkerPool> ai_workers; ///< Created with the first AI actor
+	std::vector<Actor*> thinkers; ///< Thinking this tick
+	AIView ai_view;
+	Perception perception; ///< Level index and this tick's queries of the thinkers
 	Countdown timer_powerup;
 	GameMode game;
+	GameEvents events; ///< Not yet sent to clients
+	bool deterministic; ///< Only ever on the master
+	mutable SimulatedClock sim_clock; ///< Ticks times tickPeriod()
+	mutable Rng rng; ///< Seeded with the level
+	uint32_t state_hash;
+	double next_tick; ///< Wall clock time for the next tick to start
 };
@@ -1,6 +1,9 @@
+#pragma once
+
 #include <GL/gl.h>
 #include <Box2D.h>
 
+#include "util.hh"
 #include "entity.hh"
 
 struct WorldElement: public Entity {
@@ -82,10 +85,9 @@ struct WorldElement: public Entity {
 		return SerializedEntity(getX(), getY(), w, h);
 	}
 
-	virtual void unserialize(std::string data) {
-		SerializedEntity* se = reinterpret_cast<SerializedEntity*>(&data[0]);
-		getBody()->SetTransform(b2Vec2(se->x, se->y), 0);
-		w = se->vx; h = se->vy;
+	virtual void unserialize(const SerializedEntity& se) {
+		getBody()->SetTransform(b2Vec2(se.x, se.y), 0);
+		w = se.vx; h = se.vy;
 	}
 
 	float getW() const { return w * tilesize; };
@@ -122,7 +124,7 @@ struct Crate: public WorldElement {
 		glPopMatrix();
 	}
 	virtual SerializedEntity serialize() const { return Entity::serialize(); }
-	virtual void unserialize(std::string data) { Entity::unserialize(data); }
+	virtual void unserialize(const SerializedEntity& se) { Entity::unserialize(se); }
 };
 
 struct Bridge: public WorldElement {
@@ -0,0 +1,299 @@
+// Network simulator: a UDP relay that sits between Tomaatti clients and a
+// server on one machine and injects latency, jitter, loss, reordering and
+// bandwidth limits. ENet runs over plain UDP, so the game needs no changes:
+//
+//     Tomaatti --server 1234 &
+//     Tomaatti-netsim --listen 1235 --server localhost 1234 --latency 50 --loss 2 &
+//     Tomaatti --client localhost 1235
+//
+// All randomness comes from --seed, so runs are reproducible.
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <map>
+#include <queue>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <cstdlib>
+#include <cstring>
+#include <csignal>
+#include <stdint.h>
+#include <time.h>
+#include <poll.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+namespace {
+
+	volatile sig_atomic_t quit = 0;
+	void onSignal(int) { quit = 1; }
+
+	/// Milliseconds from a monotonic clock
+	double now() {
+		timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+	}
+
+	/// Small seeded generator so that runs can be repeated exactly
+	struct Random {
+		Random(uint32_t seed): state(seed ? seed : 1) { }
+		uint32_t next() { state ^= state << 13; state ^= state >> 17; state ^= state << 5; return state; }
+		double uniform() { return next() / 4294967296.0; }
+		bool chance(double percent) { return uniform() * 100.0 < percent; }
+		uint32_t state;
+	};
+
+	/// Impairment settings of one direction
+	struct Link {
+		Link(): latency(0), jitter(0), loss(0), reorder(0), bandwidth(0), free_at(0) { }
+		double latency;   ///< ms
+		double jitter;    ///< ms, uniform +-
+		double loss;      ///< percent
+		double reorder;   ///< percent of packets held back an extra latency
+		double bandwidth; ///< kbit/s, 0 for unlimited
+		double free_at;   ///< When the simulated wire is free again
+	};
+
+	/// Datagram waiting for its delivery time
+	struct Pending {
+		double due;
+		uint64_t order; ///< Tie breaker keeping equal due times in send order
+		int fd;
+		sockaddr_in to;
+		std::string data;
+		bool operator<(const Pending& other) const {
+			return due > other.due || (due == other.due && order > other.order);
+		}
+	};
+
+	/// Counters of one direction
+	struct Stats {
+		Stats(): packets(0), bytes(0), dropped(0), reordered(0) { }
+		uint64_t packets, bytes, dropped, reordered;
+	};
+
+	std::ostream& operator<<(std::ostream& os, const Stats& s) {
+		return os << s.packets << " packets, " << s.bytes << " bytes, "
+		  << s.dropped << " dropped, " << s.reordered << " reordered";
+	}
+
+	sockaddr_in resolve(const std::string& host, int port) {
+		addrinfo hints, *res = NULL;
+		std::memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_INET;
+		hints.ai_socktype = SOCK_DGRAM;
+		if (getaddrinfo(host.c_str(), NULL, &hints, &res) != 0 || !res)
+			throw std::runtime_error("Cannot resolve " + host);
+		sockaddr_in addr = *reinterpret_cast<sockaddr_in*>(res->ai_addr);
+		addr.sin_port = htons(port);
+		freeaddrinfo(res);
+		return addr;
+	}
+
+	int udpSocket(int port = 0) {
+		int fd = socket(AF_INET, SOCK_DGRAM, 0);
+		if (fd < 0) throw std::runtime_error("Cannot create socket");
+		sockaddr_in addr;
+		std::memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_ANY);
+		addr.sin_port = htons(port);
+		if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0)
+			throw std::runtime_error("Cannot bind UDP port");
+		return fd;
+	}
+
+	struct AddressLess {
+		bool operator()(const sockaddr_in& a, const sockaddr_in& b) const {
+			if (a.sin_addr.s_addr != b.sin_addr.s_addr) return a.sin_addr.s_addr < b.sin_addr.s_addr;
+			return a.sin_port < b.sin_port;
+		}
+	};
+
+	/// Relay between any number of clients and one server
+	class Relay {
+	  public:
+		Relay(int listen_port, sockaddr_in server, uint32_t seed):
+		  m_listen(udpSocket(listen_port)), m_server(server), m_rand(seed), m_order(0) { }
+
+		~Relay() {
+			close(m_listen);
+			for (Sessions::iterator it = m_sessions.begin(); it != m_sessions.end(); ++it) close(it->second);
+		}
+
+		Link up;   ///< Client to server
+		Link down; ///< Server to client
+
+		void run(double stats_interval) {
+			double next_stats = now() + stats_interval;
+			std::vector<char> buf(65536);
+			while (!quit) {
+				// Sleep until the next delivery or incoming datagram
+				std::vector<pollfd> fds;
+				std::vector<sockaddr_in> clients;
+				pollfd pfd = { m_listen, POLLIN, 0 };
+				fds.push_back(pfd);
+				for (Sessions::iterator it = m_sessions.begin(); it != m_sessions.end(); ++it) {
+					pollfd sfd = { it->second, POLLIN, 0 };
+					fds.push_back(sfd);
+					clients.push_back(it->first);
+				}
+				int timeout = 100;
+				if (!m_queue.empty()) timeout = std::max(0, std::min(timeout, int(m_queue.top().due - now()) + 1));
+				if (poll(&fds[0], fds.size(), timeout) < 0 && !quit) continue;
+				// Client to server
+				if (fds[0].revents & POLLIN) {
+					sockaddr_in from;
+					socklen_t fromlen = sizeof(from);
+					ssize_t n = recvfrom(m_listen, &buf[0], buf.size(), 0, reinterpret_cast<sockaddr*>(&from), &fromlen);
+					if (n >= 0) schedule(up, m_up, session(from), m_server, std::string(&buf[0], n));
+				}
+				// Server to clients
+				for (size_t i = 1; i < fds.size(); ++i) {
+					if (!(fds[i].revents & POLLIN)) continue;
+					ssize_t n = recv(fds[i].fd, &buf[0], buf.size(), 0);
+					if (n >= 0) schedule(down, m_down, m_listen, clients[i-1], std::string(&buf[0], n));
+				}
+				deliver();
+				if (stats_interval > 0 && now() >= next_stats) {
+					printStats();
+					next_stats += stats_interval;
+				}
+			}
+			printStats();
+		}
+
+		void printStats() const {
+			std::cout << "up: " << m_up << std::endl << "down: " << m_down << std::endl;
+		}
+
+	  private:
+		typedef std::map<sockaddr_in, int, AddressLess> Sessions;
+
+		/// Own upstream socket per client, so the server sees separate peers
+		int session(const sockaddr_in& client) {
+			Sessions::iterator it = m_sessions.find(client);
+			if (it != m_sessions.end()) return it->second;
+			int fd = udpSocket();
+			m_sessions[client] = fd;
+			std::cout << "New client " << inet_ntoa(client.sin_addr) << ":" << ntohs(client.sin_port) << std::endl;
+			return fd;
+		}
+
+		void schedule(Link& link, Stats& stats, int fd, const sockaddr_in& to, const std::string& data) {
+			stats.packets++;
+			stats.bytes += data.size();
+			if (m_rand.chance(link.loss)) { stats.dropped++; return; }
+			double t = now();
+			// Bandwidth: packets queue up behind each other on the wire
+			if (link.bandwidth > 0) {
+				link.free_at = std::max(link.free_at, t) + data.size() * 8.0 / link.bandwidth;
+				t = link.free_at;
+			}
+			double delay = link.latency + (m_rand.uniform() * 2.0 - 1.0) * link.jitter;
+			if (m_rand.chance(link.reorder)) { delay += link.latency + link.jitter + 1.0; stats.reordered++; }
+			Pending p;
+			p.due = t + std::max(0.0, delay);
+			p.order = m_order++;
+			p.fd = fd;
+			p.to = to;
+			p.data = data;
+			m_queue.push(p);
+		}
+
+		void deliver() {
+			double t = now();
+			while (!m_queue.empty() && m_queue.top().due <= t) {
+				const Pending& p = m_queue.top();
+				sendto(p.fd, p.data.data(), p.data.size(), 0, reinterpret_cast<const sockaddr*>(&p.to), sizeof(p.to));
+				m_queue.pop();
+			}
+		}
+
+		int m_listen;
+		sockaddr_in m_server;
+		Sessions m_sessions;
+		std::priority_queue<Pending> m_queue;
+		Random m_rand;
+		uint64_t m_order;
+		Stats m_up;
+		Stats m_down;
+	};
+
+	template<typename T> T num(const char* str) {
+		std::istringstream iss(str);
+		T val;
+		if (!(iss >> val)) throw std::runtime_error(std::string("Invalid number ") + str);
+		return val;
+	}
+
+	void usage(const char* name) {
+		std::cout << "Usage: " << name << " --listen PORT --server HOST PORT [options]\n"
+		  "Options (apply to both directions, --up-* / --down-* for one):\n"
+		  "  --latency MS      one-way delay\n"
+		  "  --jitter MS       uniform random variation of the delay\n"
+		  "  --loss PERCENT    packet loss\n"
+		  "  --reorder PERCENT packets held back behind later ones\n"
+		  "  --bandwidth KBPS  link capacity\n"
+		  "  --seed N          random seed (default 1)\n"
+		  "  --stats SECONDS   print counters periodically\n";
+	}
+}
+
+
+int main(int argc, char** argv) {
+	int listen_port = 0, server_port = 0;
+	std::string server_host;
+	uint32_t seed = 1;
+	double stats_interval = 0;
+	Link up, down;
+	try {
+		for (int i = 1; i < argc; ++i) {
+			std::string arg(argv[i]);
+			bool has_val = i + 1 < argc;
+			if (arg == "--help" || arg == "-h") { usage(argv[0]); return 0; }
+			if (!has_val) throw std::runtime_error("Missing value for " + arg);
+			if (arg == "--listen") listen_port = num<int>(argv[++i]);
+			else if (arg == "--server" && i + 2 < argc) { server_host = argv[++i]; server_port = num<int>(argv[++i]); }
+			else if (arg == "--seed") seed = num<uint32_t>(argv[++i]);
+			else if (arg == "--stats") stats_interval = num<double>(argv[++i]) * 1000.0;
+			else {
+				// Link parameters, optionally for one direction only
+				bool only_up = arg.compare(0, 5, "--up-") == 0;
+				bool only_down = arg.compare(0, 7, "--down-") == 0;
+				std::string name = only_up ? arg.substr(5) : only_down ? arg.substr(7) : arg.substr(2);
+				double val = num<double>(argv[++i]);
+				Link* links[] = { only_down ? NULL : &up, only_up ? NULL : &down };
+				for (int j = 0; j < 2; ++j) {
+					Link* l = links[j];
+					if (!l) continue;
+					if (name == "latency") l->latency = val;
+					else if (name == "jitter") l->jitter = val;
+					else if (name == "loss") l->loss = val;
+					else if (name == "reorder") l->reorder = val;
+					else if (name == "bandwidth") l->bandwidth = val;
+					else throw std::runtime_error("Unrecognized option '" + arg + "'");
+				}
+			}
+		}
+		if (!listen_port || server_host.empty()) { usage(argv[0]); return 1; }
+
+		std::signal(SIGINT, onSignal);
+		std::signal(SIGTERM, onSignal);
+		Relay relay(listen_port, resolve(server_host, server_port), seed);
+		relay.up = up;
+		relay.down = down;
+		std::cout << "Relaying UDP port " << listen_port << " to " << server_host << ":" << server_port << std::endl;
+		relay.run(stats_interval);
+	} catch (std::exception& e) {
+		std::cout << "-!- FATAL ERROR: " << e.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}
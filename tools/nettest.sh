@@ -2,12 +2,20 @@
 # Script name: nettest.sh
 # Description: Script to easily test the network game on a single computer.
 #              Designed to be run from the build directory.
-# Version:     1
+#              Set NETSIM to route the clients through the network simulator,
+#              e.g. NETSIM="--latency 50 --jitter 10 --loss 2" ./nettest.sh
+# Version:     2
 
 make install
 
 Tomaatti --server &
-Tomaatti --client &
-Tomaatti --client
+if [ -n "$NETSIM" ]; then
+	./Tomaatti-netsim --listen 1235 --server localhost 1234 --stats 5 $NETSIM &
+	PORT=1235
+else
+	PORT=1234
+fi
+Tomaatti --client localhost $PORT &
+Tomaatti --client localhost $PORT
 
-killall Tomaatti
+killall Tomaatti Tomaatti-netsim
@@ -0,0 +1,90 @@
+#!/bin/sh
+# Script name: perf-regress.sh
+# Description: Plays back the input logs in PERFDIR/recordings with --benchmark
+#              and compares each against PERFDIR/baselines/NAME.txt. Fails when
+#              a playback desyncs or a figure grows more than TOLERANCE percent
+#              (default 20) past its baseline, or when it has no baseline. Logs
+#              without an end record can't be checked for desyncs and are only
+#              timed. With --update-baselines every baseline is written from
+#              this run instead of compared, commit them to track the logs.
+#              Replays in PERFDIR/replays are checked with --replay-check:
+#              seeking back to each keyframe must give the world playing did.
+#              Usage: perf-regress.sh [--update-baselines] GAME PERFDIR [TOLERANCE]
+# Version:     3
+
+UPDATE=0
+if [ "$1" = "--update-baselines" ]; then
+	UPDATE=1
+	shift
+fi
+GAME=$1
+PERFDIR=$2
+TOLERANCE=${3:-20}
+# Timings depend on the machine, the rest should not move at all
+KEYS="tick_p50 tick_p99 allocations_per_tick snapshot_bytes"
+
+if [ -z "$GAME" ] || [ -z "$PERFDIR" ]; then
+	echo "Usage: $0 [--update-baselines] GAME PERFDIR [TOLERANCE]"
+	exit 2
+fi
+
+value() { sed -n "s/^$1 = //p" "$2"; }
+
+status=0
+found=0
+for log in "$PERFDIR"/recordings/*.inputs; do
+	[ -f "$log" ] || continue
+	found=1
+	name=$(basename "$log" .inputs)
+	baseline="$PERFDIR/baselines/$name.txt"
+	out=$(mktemp)
+	"$GAME" --benchmark "$log" > "$out"
+	result=$(value result "$out")
+	[ "$result" = "unchecked" ] && echo "$name: no end record, playback not checked"
+	if [ "$result" != "ok" ] && [ "$result" != "unchecked" ]; then
+		echo "$name: playback did not match the recording"
+		cat "$out"
+		status=1
+	elif [ $UPDATE = 1 ]; then
+		mkdir -p "$PERFDIR/baselines"
+		cp "$out" "$baseline"
+		echo "$name: wrote $baseline"
+	elif [ ! -f "$baseline" ]; then
+		echo "$name: no baseline, run with --update-baselines and commit it"
+		status=1
+	else
+		for key in $KEYS; do
+			now=$(value "$key" "$out")
+			was=$(value "$key" "$baseline")
+			if awk -v now="$now" -v was="$was" -v tol="$TOLERANCE" 'BEGIN { exit !(now > was * (1 + tol / 100.0)) }'; then
+				echo "$name: $key $now, baseline $was"
+				status=1
+			else
+				echo "$name: $key $now (baseline $was)"
+			fi
+		done
+	fi
+	rm -f "$out"
+done
+
+if [ $found = 0 ]; then
+	echo "No input logs in $PERFDIR/recordings"
+	status=1
+fi
+
+for replay in "$PERFDIR"/replays/*.replay; do
+	[ -f "$replay" ] || continue
+	name=$(basename "$replay" .replay)
+	out=$(mktemp)
+	"$GAME" --replay-check "$replay" > "$out"
+	if [ "$(value result "$out")" != "ok" ]; then
+		echo "$name: seeking back does not rebuild the world"
+		cat "$out"
+		status=1
+	else
+		echo "$name: seeking ok"
+	fi
+	rm -f "$out"
+done
+
+exit $status
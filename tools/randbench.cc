@@ -0,0 +1,79 @@
+// Benchmark of the random helpers in util.hh against libc rand(), on one
+// thread and on several at once, where rand() may share a lock:
+//
+//     Tomaatti-randbench [CALLS] [THREADS]
+//
+// Prints nanoseconds per call for each.
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+
+#include "../src/util.hh"
+
+namespace {
+
+	volatile unsigned sink; // Keeps the loops from being optimized away
+
+	void libcInt(unsigned calls) {
+		unsigned sum = 0;
+		for (unsigned i = 0; i < calls; ++i) sum += rand() % 100;
+		sink = sum;
+	}
+
+	void libcFloat(unsigned calls) {
+		float sum = 0;
+		for (unsigned i = 0; i < calls; ++i) sum += rand() / float(RAND_MAX) * 10.0f;
+		sink = sum;
+	}
+
+	void helperInt(unsigned calls) {
+		unsigned sum = 0;
+		for (unsigned i = 0; i < calls; ++i) sum += randint(100);
+		sink = sum;
+	}
+
+	void helperFloat(unsigned calls) {
+		float sum = 0;
+		for (unsigned i = 0; i < calls; ++i) sum += randf(0.0f, 10.0f);
+		sink = sum;
+	}
+
+	/// Nanoseconds per call with the given number of threads each making calls
+	double measure(void (*test)(unsigned), unsigned calls, unsigned threads) {
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		boost::thread_group group;
+		for (unsigned t = 1; t < threads; ++t) group.create_thread(boost::bind(test, calls));
+		test(calls);
+		group.join_all();
+		std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+		return elapsed.count() / calls;
+	}
+}
+
+int main(int argc, char** argv) {
+	unsigned calls = argc > 1 ? str2num<unsigned>(argv[1]) : 10000000;
+	unsigned threads = argc > 2 ? str2num<unsigned>(argv[2]) : std::max(2u, boost::thread::hardware_concurrency());
+	srand(1);
+	Rng::randomize(1);
+	struct { const char* name; void (*test)(unsigned); } tests[] = {
+		{ "rand() % n", libcInt },
+		{ "randint(n)", helperInt },
+		{ "rand() float", libcFloat },
+		{ "randf(lo, hi)", helperFloat }
+	};
+	std::cout << calls << " calls per thread, ns per call" << std::endl;
+	std::cout << std::left << std::setw(16) << "" << std::right << std::setw(10) << "1 thread" << std::setw(8) << threads << " threads" << std::endl;
+	std::cout << std::fixed << std::setprecision(2);
+	for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); ++i) {
+		std::cout << std::left << std::setw(16) << tests[i].name << std::right
+		  << std::setw(10) << measure(tests[i].test, calls, 1)
+		  << std::setw(16) << measure(tests[i].test, calls, threads) << std::endl;
+	}
+	return 0;
+}